@@ -1,5 +1,20 @@
 class JSONSL
-  def self.parse(str,flags={})
-    new.parse(str,flags)
+  def self.parse_io(io,flags={})
+    new.parse_io(io,flags)
+  end
+
+  def self.lazy(str,flags={})
+    new.lazy(str,flags)
+  end
+end
+
+class JSONSL::Document
+  def dig(key, *keys)
+    value = self[key]
+    return value if keys.empty? || value.nil?
+    unless value.respond_to?(:dig)
+      raise TypeError, "#{value.class} does not have #dig method"
+    end
+    value.dig(*keys)
   end
 end
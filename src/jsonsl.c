@@ -38,6 +38,9 @@ static unsigned long StringyCatchCounter[0x100] = { 0 };
 #define INCR_METRIC(m) \
     GlobalMetrics.metric_##m++;
 
+#define ADD_METRIC(m, n) \
+    GlobalMetrics.metric_##m += (n);
+
 #define INCR_GENERIC(c) \
         INCR_METRIC(GENERIC); \
         GenericCounter[c]++; \
@@ -72,6 +75,7 @@ void jsonsl_dump_global_metrics(void)
 
 #else
 #define INCR_METRIC(m)
+#define ADD_METRIC(m, n)
 #define INCR_GENERIC(c)
 #define INCR_STRINGY_CATCH(c)
 JSONSL_API
@@ -96,20 +100,383 @@ static int is_allowed_whitespace(unsigned);
 static int is_allowed_escape(unsigned);
 static char get_escape_equiv(unsigned);
 
+/*
+ * Stage 1 of jsonsl_feed: classify the input 64 bytes at a time. Each
+ * block yields two bitmaps, one of the bytes which end a run of string
+ * contents (quotes, backslashes and the control characters of
+ * string_nopass) and one of the bytes which are not allowed whitespace.
+ * Stage 2 (the state machine) uses them to jump from one of these
+ * positions to the next instead of stepping over every byte. Builds
+ * without SSE2 skip the bitmaps and scan runs a word at a time.
+ *
+ * Define JSONSL_NO_SIMD to build without it.
+ */
+#if !defined(JSONSL_NO_SIMD) && !defined(JSONSL_USE_WCHAR)
+#define JSONSL_USE_STAGE1
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define JSONSL_STAGE1_SSE2
+#endif
+
+#define STAGE1_BLOCK 64
+#define STAGE1_STRING 0
+#define STAGE1_TOKEN 1
+
+struct jsonsl_stage1_st {
+    const jsonsl_uchar_t *base;
+    size_t len;
+    /* offset of the block the masks are for, or -1 */
+    size_t block;
+    uint64_t masks[2];
+};
+
+static JSONSL_INLINE unsigned
+stage1_ctz(uint64_t m)
+{
+#if defined(__GNUC__)
+    return (unsigned)__builtin_ctzll(m);
+#else
+    unsigned n = 0;
+    while (!(m & 1)) {
+        m >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+#if defined(__AVX2__) || defined(JSONSL_STAGE1_SSE2)
+static void
+stage1_classify_tail(const jsonsl_uchar_t *p, size_t n, uint64_t *masks)
+{
+    size_t ii;
+    /* bytes past the end of the input stop every run */
+    masks[STAGE1_STRING] = ~(uint64_t)0;
+    masks[STAGE1_TOKEN] = ~(uint64_t)0;
+    for (ii = 0; ii < n; ii++) {
+        uint64_t bit = (uint64_t)1 << ii;
+        if (!(p[ii] < 0x14 || p[ii] == '"' || p[ii] == '\\')) {
+            masks[STAGE1_STRING] &= ~bit;
+        }
+        if (is_allowed_whitespace(p[ii])) {
+            masks[STAGE1_TOKEN] &= ~bit;
+        }
+    }
+}
+
+static void
+stage1_classify(const jsonsl_uchar_t *p, uint64_t *masks)
+{
+#if defined(__AVX2__)
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i bslash = _mm256_set1_epi8('\\');
+    const __m256i ctrl = _mm256_set1_epi8(0x13);
+    const __m256i sp = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    int ii;
+
+    masks[STAGE1_STRING] = 0;
+    masks[STAGE1_TOKEN] = 0;
+    for (ii = 0; ii < STAGE1_BLOCK; ii += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + ii));
+        __m256i s = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                _mm256_cmpeq_epi8(v, bslash)),
+                _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctrl), v));
+        __m256i w = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, sp),
+                                _mm256_cmpeq_epi8(v, tab)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, lf),
+                                _mm256_cmpeq_epi8(v, cr)));
+        masks[STAGE1_STRING] |=
+                (uint64_t)(uint32_t)_mm256_movemask_epi8(s) << ii;
+        masks[STAGE1_TOKEN] |=
+                (uint64_t)(uint32_t)~_mm256_movemask_epi8(w) << ii;
+    }
+#elif defined(JSONSL_STAGE1_SSE2)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i ctrl = _mm_set1_epi8(0x13);
+    const __m128i sp = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    int ii;
+
+    masks[STAGE1_STRING] = 0;
+    masks[STAGE1_TOKEN] = 0;
+    for (ii = 0; ii < STAGE1_BLOCK; ii += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + ii));
+        __m128i s = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                             _mm_cmpeq_epi8(v, bslash)),
+                _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v));
+        __m128i w = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, sp),
+                             _mm_cmpeq_epi8(v, tab)),
+                _mm_or_si128(_mm_cmpeq_epi8(v, lf),
+                             _mm_cmpeq_epi8(v, cr)));
+        masks[STAGE1_STRING] |=
+                (uint64_t)(uint16_t)_mm_movemask_epi8(s) << ii;
+        masks[STAGE1_TOKEN] |=
+                (uint64_t)(uint16_t)~_mm_movemask_epi8(w) << ii;
+    }
+#endif
+}
+#endif /* __AVX2__ || JSONSL_STAGE1_SSE2 */
+
+#define STAGE1_ONES (~(uint64_t)0 / 255)
+#define STAGE1_HAS_ZERO(w) (((w) - STAGE1_ONES) & ~(w) & (STAGE1_ONES * 0x80))
+
+/**
+ * Returns the length of the run of string contents at `c` (at most `n`),
+ * i.e. the bytes before the next quote, backslash or string_nopass
+ * control character. Long string values are scanned this way without
+ * classifying their blocks for whitespace.
+ */
+static size_t
+stage1_string_run(const jsonsl_uchar_t *c, size_t n)
+{
+    size_t ii = 0;
+#if defined(__AVX2__)
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i bslash = _mm256_set1_epi8('\\');
+    const __m256i ctrl = _mm256_set1_epi8(0x13);
+    for (; ii + 32 <= n; ii += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(c + ii));
+        int m = _mm256_movemask_epi8(_mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                _mm256_cmpeq_epi8(v, bslash)),
+                _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctrl), v)));
+        if (m) {
+            return ii + stage1_ctz((uint32_t)m);
+        }
+    }
+#endif /* __AVX2__ */
+#if defined(__AVX2__) || defined(JSONSL_STAGE1_SSE2)
+    {
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i bslash = _mm_set1_epi8('\\');
+        const __m128i ctrl = _mm_set1_epi8(0x13);
+        for (; ii + 16 <= n; ii += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(c + ii));
+            int m = _mm_movemask_epi8(_mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                 _mm_cmpeq_epi8(v, bslash)),
+                    _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v)));
+            if (m) {
+                return ii + stage1_ctz((uint16_t)m);
+            }
+        }
+    }
+#else
+    /* Word at a time: only words with a stop byte are looked at bytewise */
+    for (; ii + 8 <= n; ii += 8) {
+        uint64_t w;
+        memcpy(&w, c + ii, 8);
+        if (((w - STAGE1_ONES * 0x14) & ~w & (STAGE1_ONES * 0x80)) ||
+                STAGE1_HAS_ZERO(w ^ (STAGE1_ONES * '"')) ||
+                STAGE1_HAS_ZERO(w ^ (STAGE1_ONES * '\\'))) {
+            break;
+        }
+    }
+#endif /* __AVX2__ || JSONSL_STAGE1_SSE2 */
+    for (; ii < n; ii++) {
+        if (c[ii] < 0x14 || c[ii] == '"' || c[ii] == '\\') {
+            break;
+        }
+    }
+    return ii;
+}
+
+/* 0x80 in each byte of `w` which is zero */
+#define STAGE1_ZERO_BYTES(w) \
+    (~((((w) & (STAGE1_ONES * 0x7f)) + STAGE1_ONES * 0x7f) | (w) | (STAGE1_ONES * 0x7f)))
+
+/**
+ * Returns the length of the run of allowed whitespace (space, tab, CR,
+ * LF) at `c` (at most `n`), e.g. the indentation of pretty-printed input.
+ */
+static size_t
+stage1_whitespace_run(const jsonsl_uchar_t *c, size_t n)
+{
+    size_t ii = 0;
+#if defined(__AVX2__)
+    const __m256i sp = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    for (; ii + 32 <= n; ii += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(c + ii));
+        uint32_t m = ~(uint32_t)_mm256_movemask_epi8(_mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, sp),
+                                _mm256_cmpeq_epi8(v, tab)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, lf),
+                                _mm256_cmpeq_epi8(v, cr))));
+        if (m) {
+            return ii + stage1_ctz(m);
+        }
+    }
+#endif /* __AVX2__ */
+#if defined(__AVX2__) || defined(JSONSL_STAGE1_SSE2)
+    {
+        const __m128i sp = _mm_set1_epi8(' ');
+        const __m128i tab = _mm_set1_epi8('\t');
+        const __m128i lf = _mm_set1_epi8('\n');
+        const __m128i cr = _mm_set1_epi8('\r');
+        for (; ii + 16 <= n; ii += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(c + ii));
+            uint32_t m = 0xffff & ~(uint32_t)_mm_movemask_epi8(_mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(v, sp),
+                                 _mm_cmpeq_epi8(v, tab)),
+                    _mm_or_si128(_mm_cmpeq_epi8(v, lf),
+                                 _mm_cmpeq_epi8(v, cr))));
+            if (m) {
+                return ii + stage1_ctz(m);
+            }
+        }
+    }
+#else
+    for (; ii + 8 <= n; ii += 8) {
+        uint64_t w;
+        memcpy(&w, c + ii, 8);
+        if ((STAGE1_ZERO_BYTES(w ^ (STAGE1_ONES * ' ')) |
+                STAGE1_ZERO_BYTES(w ^ (STAGE1_ONES * '\t')) |
+                STAGE1_ZERO_BYTES(w ^ (STAGE1_ONES * '\n')) |
+                STAGE1_ZERO_BYTES(w ^ (STAGE1_ONES * '\r'))) != STAGE1_ONES * 0x80) {
+            break;
+        }
+    }
+#endif /* __AVX2__ || JSONSL_STAGE1_SSE2 */
+    for (; ii < n; ii++) {
+        if (!is_allowed_whitespace(c[ii])) {
+            break;
+        }
+    }
+    return ii;
+}
+
+/* Whether the state machine would pass over `ch` in the state `which` */
+static JSONSL_INLINE int
+stage1_continues(int which, unsigned ch)
+{
+    if (which == STAGE1_STRING) {
+        return !(ch < 0x14 || ch == '"' || ch == '\\');
+    }
+    return is_allowed_whitespace(ch);
+}
+
+/**
+ * Returns the number of bytes from `c` (at most `n`) which the state
+ * machine would pass over in the state selected by `which`: string
+ * contents for STAGE1_STRING, whitespace for STAGE1_TOKEN. Runs which
+ * go past the classified block are finished by the scan kernels above.
+ */
+static size_t
+stage1_run(struct jsonsl_stage1_st *s1, const jsonsl_uchar_t *c, size_t n, int which)
+{
+#if defined(__AVX2__) || defined(JSONSL_STAGE1_SSE2)
+    size_t off = c - s1->base;
+    size_t block = off & ~(size_t)(STAGE1_BLOCK - 1);
+    size_t run;
+    uint64_t m;
+
+    if (block != s1->block) {
+        if (s1->len - block >= STAGE1_BLOCK) {
+            stage1_classify(s1->base + block, s1->masks);
+        } else {
+            stage1_classify_tail(s1->base + block, s1->len - block, s1->masks);
+        }
+        s1->block = block;
+    }
+    /* past the end of the input the masks are set, so only full blocks run out */
+    m = s1->masks[which] >> (off - block);
+    if (m) {
+        run = stage1_ctz(m);
+        return run < n ? run : n;
+    }
+    run = block + STAGE1_BLOCK - off;
+    if (run >= n) {
+        return n;
+    }
+    c += run;
+    n -= run;
+#else
+    /* classifying blocks a byte at a time would cost more than it saves */
+    size_t run = 0;
+    (void)s1;
+#endif /* __AVX2__ || JSONSL_STAGE1_SSE2 */
+    if (which == STAGE1_STRING) {
+        return run + stage1_string_run(c, n);
+    }
+    return run + stage1_whitespace_run(c, n);
+}
+#endif /* !JSONSL_NO_SIMD && !JSONSL_USE_WCHAR */
+
 JSONSL_API
 jsonsl_t jsonsl_new(int nlevels)
 {
-    struct jsonsl_st *jsn = (struct jsonsl_st *)
-            calloc(1, sizeof (*jsn) +
-                    ( (nlevels-1) * sizeof (struct jsonsl_state_st) )
-            );
+    unsigned int ii, nalloc;
+    struct jsonsl_st *jsn = (struct jsonsl_st *)calloc(1, sizeof (*jsn));
+
+    if (!jsn) {
+        return NULL;
+    }
+    nalloc = nlevels < JSONSL_INITIAL_LEVELS ? nlevels : JSONSL_INITIAL_LEVELS;
+    if (nalloc < 1) {
+        nalloc = 1;
+    }
+    jsn->stack = (struct jsonsl_state_st *)
+            calloc(nalloc, sizeof (struct jsonsl_state_st));
+    if (!jsn->stack) {
+        free(jsn);
+        return NULL;
+    }
+    for (ii = 0; ii < nalloc; ii++) {
+        jsn->stack[ii].level = ii;
+    }
 
     jsn->levels_max = nlevels;
+    jsn->levels_alloc = nalloc;
     jsn->max_callback_level = -1;
     jsonsl_reset(jsn);
     return jsn;
 }
 
+/**
+ * Makes room for a deeper level, doubling the stack up to levels_max.
+ * New states are cleared as jsonsl_reset() would. Returns 0 if the
+ * stack cannot be reallocated.
+ */
+static int
+jsonsl__grow_stack(jsonsl_t jsn)
+{
+    unsigned int ii, nalloc = jsn->levels_alloc * 2;
+    struct jsonsl_state_st *stack;
+
+    if (nalloc > jsn->levels_max) {
+        nalloc = jsn->levels_max;
+    }
+    stack = (struct jsonsl_state_st *)
+            realloc(jsn->stack, nalloc * sizeof (struct jsonsl_state_st));
+    if (!stack) {
+        return 0;
+    }
+    memset(stack + jsn->levels_alloc, 0,
+           (nalloc - jsn->levels_alloc) * sizeof (struct jsonsl_state_st));
+    for (ii = jsn->levels_alloc; ii < nalloc; ii++) {
+        stack[ii].level = ii;
+    }
+    jsn->stack = stack;
+    jsn->levels_alloc = nalloc;
+    return 1;
+}
+
 JSONSL_API
 void jsonsl_reset(jsonsl_t jsn)
 {
@@ -122,17 +489,20 @@ void jsonsl_reset(jsonsl_t jsn)
     jsn->in_escape = 0;
     jsn->expecting = 0;
 
-    memset(jsn->stack, 0, (jsn->levels_max * sizeof (struct jsonsl_state_st)));
+    /* deeper states are still as they were allocated or last reset */
+    memset(jsn->stack, 0, ((jsn->levels_used + 1) * sizeof (struct jsonsl_state_st)));
 
-    for (ii = 0; ii < jsn->levels_max; ii++) {
+    for (ii = 0; ii <= jsn->levels_used; ii++) {
         jsn->stack[ii].level = ii;
     }
+    jsn->levels_used = 0;
 }
 
 JSONSL_API
 void jsonsl_destroy(jsonsl_t jsn)
 {
     if (jsn) {
+        free(jsn->stack);
         free(jsn);
     }
 }
@@ -149,11 +519,15 @@ jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes)
     return;
 
 #define STACK_PUSH \
-    if (jsn->level >= (levels_max-1)) { \
+    if (jsn->level >= (levels_max-1) || \
+            (jsn->level + 1 >= jsn->levels_alloc && !jsonsl__grow_stack(jsn))) { \
         jsn->error_callback(jsn, JSONSL_ERROR_LEVELS_EXCEEDED, state, (char*)c); \
         return; \
     } \
     state = jsn->stack + (++jsn->level); \
+    if (jsn->level > jsn->levels_used) { \
+        jsn->levels_used = jsn->level; \
+    } \
     state->ignore_callback = jsn->stack[jsn->level-1].ignore_callback; \
     state->pos_begin = jsn->pos;
 
@@ -218,10 +592,35 @@ jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes)
 
 #define STATE_NUM_LAST jsn->tok_last
 
+/* nelem * 10 + digit overflows 64 bits from here */
+#define NUM_OVERFLOW_MIN ((~(uint64_t)0) / 10)
+#define NUM_OVERFLOW_DIGIT ((unsigned)((~(uint64_t)0) % 10))
+
+#ifdef JSONSL_USE_STAGE1
+/* Move onto the last byte of the run after CUR_CHAR; GT_NEXT steps past it */
+#define STAGE1_JUMP(which, m) \
+    if (nbytes > 1 && stage1_continues(which, c[1])) { \
+        size_t run_ = stage1_run(&stage1, c + 1, nbytes - 1, which); \
+        c += run_; \
+        jsn->pos += run_; \
+        nbytes -= run_; \
+        ADD_METRIC(TOTAL, run_); \
+        ADD_METRIC(m, run_); \
+    }
+#else
+#define STAGE1_JUMP(which, m)
+#endif /* JSONSL_USE_STAGE1 */
+
     const jsonsl_uchar_t *c = (jsonsl_uchar_t*)bytes;
     size_t levels_max = jsn->levels_max;
     struct jsonsl_state_st *state = jsn->stack + jsn->level;
     static int chrt_string_nopass[0x100] = { JSONSL_CHARTABLE_string_nopass };
+#ifdef JSONSL_USE_STAGE1
+    struct jsonsl_stage1_st stage1;
+    stage1.base = c;
+    stage1.len = nbytes;
+    stage1.block = (size_t)-1;
+#endif /* JSONSL_USE_STAGE1 */
     jsn->base = bytes;
 
     for (; nbytes; nbytes--, jsn->pos++, c++) {
@@ -255,6 +654,7 @@ jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes)
 #endif /* JSONSL_USE_WCHAR */
                     (!chrt_string_nopass[CUR_CHAR & 0xff])) {
                 INCR_METRIC(STRINGY_INSIGNIFICANT);
+                STAGE1_JUMP(STAGE1_STRING, STRINGY_INSIGNIFICANT);
                 goto GT_NEXT;
             } else if (CUR_CHAR == '"') {
                 goto GT_QUOTE;
@@ -269,6 +669,13 @@ jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes)
             /* Fast track for signed/unsigned */
             if (IS_NORMAL_NUMBER) {
                 if (isdigit(CUR_CHAR)) {
+                    if (state->nelem >= NUM_OVERFLOW_MIN &&
+                            (state->nelem > NUM_OVERFLOW_MIN ||
+                                    (unsigned)(CUR_CHAR-0x30) > NUM_OVERFLOW_DIGIT)) {
+                        /* the rest of the digits go through the slow path */
+                        state->special_flags |= JSONSL_SPECIALf_OVERFLOW;
+                        goto GT_SPECIAL_NUMERIC;
+                    }
                     state->nelem = (state->nelem * 10) + (CUR_CHAR-0x30);
                     goto GT_NEXT;
                 } else {
@@ -291,7 +698,7 @@ jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes)
 
                 goto GT_NEXT;
 
-            } else if (state->special_flags == JSONSL_SPECIALf_ZERO) {
+            } else if ((state->special_flags & ~JSONSL_SPECIALf_SIGNED) == JSONSL_SPECIALf_ZERO) {
                 if (isdigit(CUR_CHAR)) {
                     /* Following a zero! */
                     INVOKE_ERROR(INVALID_NUMBER);
@@ -393,6 +800,7 @@ jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes)
             SPECIAL_POP;
             jsn->expecting = ',';
             if (is_allowed_whitespace(CUR_CHAR)) {
+                STAGE1_JUMP(STAGE1_TOKEN, ALLOWED_WHITESPACE);
                 goto GT_NEXT;
             }
             /**
@@ -408,10 +816,15 @@ jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes)
             /* So we're not special. Harmless insignificant whitespace
              * passthrough
              */
+            STAGE1_JUMP(STAGE1_TOKEN, ALLOWED_WHITESPACE);
             goto GT_NEXT;
         } else if (extract_special(CUR_CHAR)) {
             /* not a string, whitespace, or structural token. must be special */
             goto GT_SPECIAL_BEGIN;
+        } else if (CUR_CHAR == 0x1e && jsn->level == 0 &&
+                jsn->options.allow_multiple_values) {
+            /* RFC 7464 record separator between top-level values */
+            goto GT_NEXT;
         }
 
         INCR_GENERIC(CUR_CHAR);
@@ -561,10 +974,19 @@ jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes)
                 INVOKE_ERROR(TRAILING_COMMA);
             }
 
+            if (jsn->level == 0) {
+                /* nothing is open to close */
+                INVOKE_ERROR(STRAY_TOKEN);
+            }
             jsn->can_insert = 0;
             jsn->level--;
             jsn->expecting = ',';
             jsn->tok_last = 0;
+            if (jsn->level == 0 && jsn->options.allow_multiple_values) {
+                /* ready for the next top-level value */
+                jsn->can_insert = 1;
+                jsn->expecting = 0;
+            }
             if (CUR_CHAR == ']') {
                 if (state->type != '[') {
                     INVOKE_ERROR(BRACKET_MISMATCH);
@@ -797,7 +1219,7 @@ jsonsl_jpr_new(const char *path, jsonsl_error_t *errp)
     }
 
     components = (struct jsonsl_jpr_component_st *)
-            malloc(sizeof(*components) * count);
+            calloc(count, sizeof(*components));
     if (!components) {
         JPR_BAIL(JSONSL_ERROR_ENOMEM);
     }
@@ -946,25 +1368,300 @@ jsonsl_jpr_match(jsonsl_jpr_t jpr,
     return JSONSL_MATCH_NOMATCH;
 }
 
+/*
+ * The JPRs given to jsonsl_jpr_match_state_init() are compiled into one
+ * deterministic automaton. Each node stands for the set of path positions
+ * reachable with the keys seen so far, and has hashed edges for object
+ * keys and list indices plus a wildcard edge. Whatever a wildcard would
+ * match is merged into each keyed edge of the same node, so a child is
+ * matched with a single lookup however many JPRs there are.
+ */
+struct jsonsl_jpr_edge_st {
+    /** Object key, or NULL for a list index */
+    const char *key;
+    /** Key length, or the list index */
+    size_t nkey;
+    unsigned long hash;
+    struct jsonsl_jpr_node_st *child;
+};
+
+struct jsonsl_jpr_node_st {
+    struct jsonsl_jpr_edge_st *keys;
+    size_t keys_mask;
+    struct jsonsl_jpr_edge_st *indices;
+    size_t indices_mask;
+    struct jsonsl_jpr_node_st *wildcard;
+    /** Positions (in the array given to match_state_init) of JPRs ending here */
+    size_t *complete;
+    size_t ncomplete;
+};
+
+/* A JPR and the position of its next component */
+struct jsonsl_jpr_item_st {
+    size_t jpridx;
+    size_t comp;
+};
+
+static unsigned long
+jpr_hash(const char *key, size_t nkey)
+{
+    /* FNV-1a */
+    unsigned long hash = 2166136261UL;
+    size_t ii;
+    for (ii = 0; ii < nkey; ii++) {
+        hash ^= (unsigned char)key[ii];
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+static struct jsonsl_jpr_edge_st *
+jpr_edges_new(size_t count, size_t *mask)
+{
+    size_t capa = 2;
+    while (capa < count * 2) {
+        capa *= 2;
+    }
+    *mask = capa - 1;
+    return (struct jsonsl_jpr_edge_st *)calloc(capa, sizeof(struct jsonsl_jpr_edge_st));
+}
+
+static void
+jpr_edge_insert(struct jsonsl_jpr_edge_st *edges, size_t mask,
+                const char *key, size_t nkey, struct jsonsl_jpr_node_st *child)
+{
+    unsigned long hash = key ? jpr_hash(key, nkey) : (unsigned long)nkey;
+    size_t ii = hash & mask;
+    while (edges[ii].child) {
+        ii = (ii + 1) & mask;
+    }
+    edges[ii].key = key;
+    edges[ii].nkey = nkey;
+    edges[ii].hash = hash;
+    edges[ii].child = child;
+}
+
+static struct jsonsl_jpr_node_st *
+jpr_edge_find(struct jsonsl_jpr_edge_st *edges, size_t mask,
+              const char *key, size_t nkey)
+{
+    unsigned long hash;
+    size_t ii;
+
+    if (!edges) {
+        return NULL;
+    }
+    hash = key ? jpr_hash(key, nkey) : (unsigned long)nkey;
+    for (ii = hash & mask; edges[ii].child; ii = (ii + 1) & mask) {
+        if (edges[ii].hash != hash || edges[ii].nkey != nkey) {
+            continue;
+        }
+        if (!key || memcmp(edges[ii].key, key, nkey) == 0) {
+            return edges[ii].child;
+        }
+    }
+    return NULL;
+}
+
+static void
+jpr_node_destroy(struct jsonsl_jpr_node_st *node)
+{
+    size_t ii;
+    if (!node) {
+        return;
+    }
+    for (ii = 0; node->keys && ii <= node->keys_mask; ii++) {
+        jpr_node_destroy(node->keys[ii].child);
+    }
+    for (ii = 0; node->indices && ii <= node->indices_mask; ii++) {
+        jpr_node_destroy(node->indices[ii].child);
+    }
+    jpr_node_destroy(node->wildcard);
+    free(node->keys);
+    free(node->indices);
+    free(node->complete);
+    free(node);
+}
+
+#define JPR_ITEM_COMPONENT(jsn, item) \
+    (jsn->jprs[(item)->jpridx]->components + (item)->comp)
+
+/* Whether the component matches an object key (or else a list index) */
+static int
+jpr_component_matches(struct jsonsl_jpr_component_st *comp, int is_list)
+{
+    if (is_list) {
+        return comp->ptype == JSONSL_PATH_NUMERIC;
+    }
+    return comp->ptype == JSONSL_PATH_STRING ||
+            (comp->ptype == JSONSL_PATH_NUMERIC && !comp->is_arridx);
+}
+
+static struct jsonsl_jpr_node_st *
+jpr_node_build(jsonsl_t jsn, struct jsonsl_jpr_item_st *items, size_t nitems);
+
+/*
+ * Adds the keyed (or indexed) edges of a node: items with equal keys
+ * go to the same child, together with the wildcard items.
+ */
+static int
+jpr_node_build_edges(jsonsl_t jsn, struct jsonsl_jpr_node_st *node,
+                     struct jsonsl_jpr_item_st *items, size_t nitems,
+                     struct jsonsl_jpr_item_st *wild, size_t nwild,
+                     int is_list)
+{
+    struct jsonsl_jpr_item_st *group;
+    struct jsonsl_jpr_edge_st *edges;
+    struct jsonsl_jpr_component_st *comp, *other;
+    struct jsonsl_jpr_node_st *child;
+    char *done;
+    size_t ii, jj, ngroup, nedges = 0, mask;
+    const char *key;
+    size_t nkey;
+
+    for (ii = 0; ii < nitems; ii++) {
+        if (jpr_component_matches(JPR_ITEM_COMPONENT(jsn, items + ii), is_list)) {
+            nedges++;
+        }
+    }
+    if (!nedges) {
+        return 1;
+    }
+
+    edges = jpr_edges_new(nedges, &mask);
+    group = (struct jsonsl_jpr_item_st *)malloc(sizeof(*group) * (nitems + nwild));
+    done = (char *)calloc(nitems, 1);
+    if (is_list) {
+        node->indices = edges;
+        node->indices_mask = mask;
+    } else {
+        node->keys = edges;
+        node->keys_mask = mask;
+    }
+    if (!edges || !group || !done) {
+        free(group);
+        free(done);
+        return 0;
+    }
+
+    for (ii = 0; ii < nitems; ii++) {
+        comp = JPR_ITEM_COMPONENT(jsn, items + ii);
+        if (done[ii] || !jpr_component_matches(comp, is_list)) {
+            continue;
+        }
+        ngroup = 0;
+        for (jj = ii; jj < nitems; jj++) {
+            other = JPR_ITEM_COMPONENT(jsn, items + jj);
+            if (done[jj] || !jpr_component_matches(other, is_list)) {
+                continue;
+            }
+            if (is_list ? other->idx != comp->idx :
+                    (other->len != comp->len ||
+                            memcmp(other->pstr, comp->pstr, comp->len) != 0)) {
+                continue;
+            }
+            done[jj] = 1;
+            group[ngroup].jpridx = items[jj].jpridx;
+            group[ngroup].comp = items[jj].comp + 1;
+            ngroup++;
+        }
+        memcpy(group + ngroup, wild, sizeof(*wild) * nwild);
+
+        child = jpr_node_build(jsn, group, ngroup + nwild);
+        if (!child) {
+            free(group);
+            free(done);
+            return 0;
+        }
+        key = is_list ? NULL : comp->pstr;
+        nkey = is_list ? comp->idx : comp->len;
+        jpr_edge_insert(edges, mask, key, nkey, child);
+    }
+    free(group);
+    free(done);
+    return 1;
+}
+
+static struct jsonsl_jpr_node_st *
+jpr_node_build(jsonsl_t jsn, struct jsonsl_jpr_item_st *items, size_t nitems)
+{
+    struct jsonsl_jpr_node_st *node;
+    struct jsonsl_jpr_item_st *wild = NULL, *rest = NULL;
+    size_t ii, nwild = 0, nrest = 0;
+    int ok = 0;
+
+    node = (struct jsonsl_jpr_node_st *)calloc(1, sizeof(*node));
+    if (!node) {
+        return NULL;
+    }
+    node->complete = (size_t *)malloc(sizeof(size_t) * nitems);
+    wild = (struct jsonsl_jpr_item_st *)malloc(sizeof(*wild) * nitems);
+    rest = (struct jsonsl_jpr_item_st *)malloc(sizeof(*rest) * nitems);
+    if (!node->complete || !wild || !rest) {
+        goto GT_DONE;
+    }
+
+    for (ii = 0; ii < nitems; ii++) {
+        if (items[ii].comp == jsn->jprs[items[ii].jpridx]->ncomponents) {
+            node->complete[node->ncomplete++] = items[ii].jpridx;
+        } else if (JPR_ITEM_COMPONENT(jsn, items + ii)->ptype == JSONSL_PATH_WILDCARD) {
+            wild[nwild].jpridx = items[ii].jpridx;
+            wild[nwild].comp = items[ii].comp + 1;
+            nwild++;
+        } else {
+            rest[nrest++] = items[ii];
+        }
+    }
+
+    if (nwild) {
+        node->wildcard = jpr_node_build(jsn, wild, nwild);
+        if (!node->wildcard) {
+            goto GT_DONE;
+        }
+    }
+    ok = jpr_node_build_edges(jsn, node, rest, nrest, wild, nwild, 0) &&
+            jpr_node_build_edges(jsn, node, rest, nrest, wild, nwild, 1);
+
+    GT_DONE:
+    free(wild);
+    free(rest);
+    if (!ok) {
+        jpr_node_destroy(node);
+        return NULL;
+    }
+    return node;
+}
+
+#undef JPR_ITEM_COMPONENT
+
 JSONSL_API
 void jsonsl_jpr_match_state_init(jsonsl_t jsn,
                                  jsonsl_jpr_t *jprs,
                                  size_t njprs)
 {
-    size_t ii, *firstjmp;
+    struct jsonsl_jpr_item_st *items;
+    size_t ii;
     if (njprs == 0) {
         return;
     }
     jsn->jprs = (jsonsl_jpr_t *)malloc(sizeof(jsonsl_jpr_t) * njprs);
     jsn->jpr_count = njprs;
-    jsn->jpr_root = (size_t*)calloc(1, sizeof(size_t) * njprs * jsn->levels_max);
+    jsn->jpr_levels = (struct jsonsl_jpr_node_st **)
+            calloc(jsn->levels_max, sizeof(struct jsonsl_jpr_node_st *));
+    items = (struct jsonsl_jpr_item_st *)malloc(sizeof(*items) * njprs);
+    if (!jsn->jprs || !jsn->jpr_levels || !items) {
+        free(items);
+        return;
+    }
     memcpy(jsn->jprs, jprs, sizeof(jsonsl_jpr_t) * njprs);
-    /* Set the initial jump table values */
 
-    firstjmp = jsn->jpr_root;
+    /* The top-level element is the root component of every path */
     for (ii = 0; ii < njprs; ii++) {
-        firstjmp[ii] = ii+1;
+        items[ii].jpridx = ii;
+        items[ii].comp = 1;
     }
+    jsn->jpr_dfa = jpr_node_build(jsn, items, njprs);
+    free(items);
 }
 
 JSONSL_API
@@ -974,25 +1671,23 @@ void jsonsl_jpr_match_state_cleanup(jsonsl_t jsn)
         return;
     }
 
-    free(jsn->jpr_root);
+    jpr_node_destroy(jsn->jpr_dfa);
+    free(jsn->jpr_levels);
     free(jsn->jprs);
     jsn->jprs = NULL;
-    jsn->jpr_root = NULL;
+    jsn->jpr_dfa = NULL;
+    jsn->jpr_levels = NULL;
     jsn->jpr_count = 0;
 }
 
 /**
  * This function should be called exactly once on each element...
  * This should also be called in recursive order, since we rely
- * on the parent having been initalized for a match.
- *
- * Since the parent is checked for a match as well, we maintain a 'serial' counter.
- * Whenever we traverse an element, we expect the serial to be the same as a global
- * integer. If they do not match, we re-initialize the context, and set the serial.
- *
- * This ensures a type of consistency without having a proactive reset by the
- * main lexer itself.
+ * on the parent having been matched already.
  *
+ * The automaton node reached by each level is kept in jpr_levels; a child
+ * follows the edge for its key (or index) from its parent's node, or the
+ * parent's wildcard edge.
  */
 JSONSL_API
 jsonsl_jpr_t jsonsl_jpr_match_state(jsonsl_t jsn,
@@ -1002,61 +1697,55 @@ jsonsl_jpr_t jsonsl_jpr_match_state(jsonsl_t jsn,
                                     jsonsl_jpr_match_t *out)
 {
     struct jsonsl_state_st *parent_state;
-    jsonsl_jpr_t ret = NULL;
+    struct jsonsl_jpr_node_st *parent, *node = NULL;
 
-    /* Jump and JPR tables for our own state and the parent state */
-    size_t *jmptable, *pjmptable;
-    size_t jmp_cur, ii, ourjmpidx;
-
-    if (!jsn->jpr_root) {
+    if (!jsn->jpr_dfa) {
         *out = JSONSL_MATCH_NOMATCH;
         return NULL;
     }
 
-    pjmptable = jsn->jpr_root + (jsn->jpr_count * (state->level-1));
-    jmptable = pjmptable + jsn->jpr_count;
+    if (state->level == 1) {
+        node = jsn->jpr_dfa;
+    } else if ((parent = jsn->jpr_levels[state->level-1]) != NULL) {
+        parent_state = jsn->stack + state->level - 1;
+        if (parent_state->type == JSONSL_T_LIST) {
+            /* nelem has already been incremented for this element */
+            node = jpr_edge_find(parent->indices, parent->indices_mask,
+                                 NULL, (size_t) parent_state->nelem - 1);
+        } else if (parent_state->type == JSONSL_T_OBJECT) {
+            node = jpr_edge_find(parent->keys, parent->keys_mask, key, nkey);
+        }
+        if (!node) {
+            node = parent->wildcard;
+        }
+    }
+    jsn->jpr_levels[state->level] = node;
 
-    /* If the parent cannot match, then invalidate it */
-    if (*pjmptable == 0) {
-        *jmptable = 0;
+    if (!node) {
         *out = JSONSL_MATCH_NOMATCH;
         return NULL;
     }
-
-    parent_state = jsn->stack + state->level - 1;
-
-    if (parent_state->type == JSONSL_T_LIST) {
-        nkey = (size_t) parent_state->nelem;
+    if (node->ncomplete) {
+        *out = JSONSL_MATCH_COMPLETE;
+        return jsn->jprs[node->complete[0]];
     }
+    *out = JSONSL_MATCH_POSSIBLE;
+    return NULL;
+}
 
-    *jmptable = 0;
-    ourjmpidx = 0;
-    memset(jmptable, 0, sizeof(int) * jsn->jpr_count);
+JSONSL_API
+size_t jsonsl_jpr_match_state_complete(jsonsl_t jsn,
+                                       struct jsonsl_state_st *state,
+                                       const size_t **indices)
+{
+    struct jsonsl_jpr_node_st *node;
 
-    for (ii = 0; ii <  jsn->jpr_count; ii++) {
-        jmp_cur = pjmptable[ii];
-        if (jmp_cur) {
-            jsonsl_jpr_t jpr = jsn->jprs[jmp_cur-1];
-            *out = jsonsl_jpr_match(jpr,
-                                    parent_state->type,
-                                    parent_state->level,
-                                    key, nkey);
-            if (*out == JSONSL_MATCH_COMPLETE) {
-                ret = jpr;
-                *jmptable = 0;
-                return ret;
-            } else if (*out == JSONSL_MATCH_POSSIBLE) {
-                jmptable[ourjmpidx] = ii+1;
-                ourjmpidx++;
-            }
-        } else {
-            break;
-        }
-    }
-    if (!*jmptable) {
-        *out = JSONSL_MATCH_NOMATCH;
+    if (!jsn->jpr_levels || !(node = jsn->jpr_levels[state->level])) {
+        *indices = NULL;
+        return 0;
     }
-    return NULL;
+    *indices = node->complete;
+    return node->ncomplete;
 }
 
 JSONSL_API
@@ -1194,6 +1883,143 @@ size_t jsonsl_util_unescape_ex(const char *in,
     return origlen - ndiff;
 }
 
+/**
+ * Copies the bytes at `c` (at most `n`) which come before the next
+ * backslash to `out` and returns their number. Blocks of 16 bytes
+ * (or words, without SSE2) are stored whole before they are checked, so
+ * `out` must have room for all `n` bytes.
+ */
+static JSONSL_INLINE size_t
+unescape_copy_run(const unsigned char *c, size_t n, char *out)
+{
+    size_t ii = 0;
+#ifdef JSONSL_USE_STAGE1
+#if defined(__AVX2__) || defined(JSONSL_STAGE1_SSE2)
+    /* escapes are usually close together: 32-byte blocks would not pay */
+    const __m128i bslash = _mm_set1_epi8('\\');
+    for (; ii + 16 <= n; ii += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(c + ii));
+        int m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, bslash));
+        _mm_storeu_si128((__m128i *)(out + ii), v);
+        if (m) {
+            return ii + stage1_ctz((uint16_t)m);
+        }
+    }
+#else
+    for (; ii + 8 <= n; ii += 8) {
+        uint64_t w;
+        memcpy(&w, c + ii, 8);
+        if (STAGE1_HAS_ZERO(w ^ (STAGE1_ONES * '\\'))) {
+            break;
+        }
+        memcpy(out + ii, &w, 8);
+    }
+#endif /* __AVX2__ || JSONSL_STAGE1_SSE2 */
+#endif /* JSONSL_USE_STAGE1 */
+    for (; ii < n && c[ii] != '\\'; ii++) {
+        out[ii] = (char)c[ii];
+    }
+    return ii;
+}
+
+/* The value of the four hex digits at `c`, or -1 */
+static long
+unescape_hex4(const unsigned char *c)
+{
+    long v = 0;
+    int ii;
+    for (ii = 0; ii < 4; ii++) {
+        unsigned d = c[ii];
+        if (d - '0' < 10) {
+            d -= '0';
+        } else if ((d | 0x20) - 'a' < 6) {
+            d = (d | 0x20) - 'a' + 10;
+        } else {
+            return -1;
+        }
+        v = (v << 4) | d;
+    }
+    return v;
+}
+
+JSONSL_API
+size_t jsonsl_util_unescape_utf8(const char *in,
+                                 char *out,
+                                 size_t len,
+                                 jsonsl_error_t *err,
+                                 const char **errat)
+{
+    const unsigned char *c = (const unsigned char*)in;
+    const unsigned char *end = c + len;
+    char *o = out;
+    long cp, lo;
+    size_t run;
+
+    while (c < end) {
+        if (*c != '\\') {
+            run = unescape_copy_run(c, (size_t)(end - c), o);
+            c += run;
+            o += run;
+            if (c == end) {
+                break;
+            }
+        }
+
+        /* c[0] == '\\' */
+        if (end - c < 2) {
+            UNESCAPE_BAIL(ESCAPE_INVALID, 0);
+        }
+        if (!is_allowed_escape(c[1])) {
+            UNESCAPE_BAIL(ESCAPE_INVALID, 1);
+        }
+        if (c[1] != 'u') {
+            /* \\, \" and \/ have no replacement but themselves */
+            char esctmp = get_escape_equiv(c[1]);
+            *(o++) = esctmp ? esctmp : (char)c[1];
+            c += 2;
+            continue;
+        }
+
+        /* next == 'u' */
+        if (end - c < 6 || (cp = unescape_hex4(c + 2)) < 0) {
+            UNESCAPE_BAIL(UESCAPE_TOOSHORT, -1);
+        }
+        c += 6;
+        if (cp >= 0xD800 && cp <= 0xDBFF) {
+            /* a high surrogate must be followed by a low one */
+            if (end - c >= 6 && c[0] == '\\' && c[1] == 'u' &&
+                    (lo = unescape_hex4(c + 2)) >= 0xDC00 && lo <= 0xDFFF) {
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                c += 6;
+            } else {
+                cp = 0xFFFD;
+            }
+        } else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+            cp = 0xFFFD;
+        }
+
+        /* six or twelve bytes of input give at most three or four */
+        if (cp < 0x80) {
+            *(o++) = (char)cp;
+        } else if (cp < 0x800) {
+            *(o++) = (char)(0xC0 | (cp >> 6));
+            *(o++) = (char)(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            *(o++) = (char)(0xE0 | (cp >> 12));
+            *(o++) = (char)(0x80 | ((cp >> 6) & 0x3F));
+            *(o++) = (char)(0x80 | (cp & 0x3F));
+        } else {
+            *(o++) = (char)(0xF0 | (cp >> 18));
+            *(o++) = (char)(0x80 | ((cp >> 12) & 0x3F));
+            *(o++) = (char)(0x80 | ((cp >> 6) & 0x3F));
+            *(o++) = (char)(0x80 | (cp & 0x3F));
+        }
+    }
+    *err = JSONSL_ERROR_SUCCESS;
+    return (size_t)(o - out);
+}
+#undef UNESCAPE_BAIL
+
 /**
  * Character Table definitions.
  * These were all generated via srcutil/genchartables.pl
@@ -1374,6 +2200,7 @@ int jsonsl_is_allowed_escape(unsigned char c)
 
 /* Clean up all our macros! */
 #undef INCR_METRIC
+#undef ADD_METRIC
 #undef INCR_GENERIC
 #undef INCR_STRINGY_CATCH
 #undef CASE_DIGITS
@@ -1382,6 +2209,12 @@ int jsonsl_is_allowed_escape(unsigned char c)
 #undef STACK_POP_NOPOS
 #undef STACK_POP
 #undef CALLBACK_AND_POP_NOPOS
+#undef STAGE1_JUMP
+#undef NUM_OVERFLOW_MIN
+#undef NUM_OVERFLOW_DIGIT
+#undef STAGE1_ONES
+#undef STAGE1_HAS_ZERO
+#undef STAGE1_ZERO_BYTES
 #undef CALLBACK_AND_POP
 #undef SPECIAL_POP
 #undef CUR_CHAR
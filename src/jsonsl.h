@@ -88,10 +88,19 @@ typedef int ssize_t;
 
 #define JSONSL_MAX_LEVELS 512
 
+/**
+ * Number of levels the stack is allocated with; it grows on demand up
+ * to the nlevels given to jsonsl_new()
+ */
+#ifndef JSONSL_INITIAL_LEVELS
+#define JSONSL_INITIAL_LEVELS 32
+#endif
+
 struct jsonsl_st;
 typedef struct jsonsl_st *jsonsl_t;
 
 typedef struct jsonsl_jpr_st* jsonsl_jpr_t;
+struct jsonsl_jpr_node_st;
 
 /**
  * This flag is true when AND'd against a type whose value
@@ -158,6 +167,9 @@ typedef enum {
     /** @private */
     JSONSL_SPECIALf_DASH    = 1 << 10,
 
+    /** The digits of an integer do not fit in 64 bits, so nelem is unset */
+    JSONSL_SPECIALf_OVERFLOW = 1 << 11,
+
     /** Type is numeric */
     JSONSL_SPECIALf_NUMERIC = (JSONSL_SPECIALf_SIGNED| JSONSL_SPECIALf_UNSIGNED),
 
@@ -371,36 +383,6 @@ struct jsonsl_state_st {
  */
 #define JSONSL_NUMERIC_VALUE(st) ((st)->nelem)
 
-/*
- * So now we need some special structure for keeping the
- * JPR info in sync. Preferrably all in a single block
- * of memory (there's no need for separate allocations.
- * So we will define a 'table' with the following layout
- *
- * Level    nPosbl  JPR1_last   JPR2_last   JPR3_last
- *
- * 0        1       NOMATCH     POSSIBLE    POSSIBLE
- * 1        0       NOMATCH     NOMATCH     COMPLETE
- * [ table ends here because no further path is possible]
- *
- * Where the JPR..n corresponds to the number of JPRs
- * requested, and nPosble is a quick flag to determine
- *
- * the number of possibilities. In the future this might
- * be made into a proper 'jump' table,
- *
- * Since we always mark JPRs from the higher levels descending
- * into the lower ones, a prospective child match would first
- * look at the parent table to check the possibilities, and then
- * see which ones were possible..
- *
- * Thus, the size of this blob would be (and these are all ints here)
- * nLevels * nJPR * 2.
- *
- * the 'Width' of the table would be nJPR*2, and the 'height' would be
- * nlevels
- */
-
 /**
  * This is called when a stack change ocurs.
  *
@@ -522,6 +504,12 @@ struct jsonsl_st {
 
     struct {
         int allow_trailing_comma;
+        /**
+         * Accept further top-level values once the first one is closed,
+         * e.g. concatenated JSON or RFC 7464 JSON text sequences. Record
+         * separators (0x1E) are then skipped between values.
+         */
+        int allow_multiple_values;
     } options;
 
     /** Put anything here */
@@ -534,29 +522,34 @@ struct jsonsl_st {
     char tok_last;
     int can_insert;
     unsigned int levels_max;
+    unsigned int levels_alloc;  /* states allocated in stack */
+    unsigned int levels_used;   /* deepest level since the last reset */
 
 #ifndef JSONSL_NO_JPR
     size_t jpr_count;
     jsonsl_jpr_t *jprs;
 
-    /* Root pointer for JPR matching information */
-    size_t *jpr_root;
+    /* Automaton compiled from the JPRs, and the node reached at each level */
+    struct jsonsl_jpr_node_st *jpr_dfa;
+    struct jsonsl_jpr_node_st **jpr_levels;
 #endif /* JSONSL_NO_JPR */
     /*@}*/
 
     /**
-     * This is the stack. Its upper bound is levels_max, or the
-     * nlevels argument passed to jsonsl_new. If you modify this structure,
-     * make sure that this member is last.
+     * This is the stack. It holds levels_alloc states and grows as the
+     * document nests deeper, up to levels_max, or the nlevels argument
+     * passed to jsonsl_new.
      */
-    struct jsonsl_state_st stack[1];
+    struct jsonsl_state_st *stack;
 };
 
 
 /**
- * Creates a new lexer object, with capacity for recursion up to nlevels
+ * Creates a new lexer object, with capacity for recursion up to nlevels.
+ * The stack starts with JSONSL_INITIAL_LEVELS levels and grows on demand.
  *
  * @param nlevels maximum recursion depth
+ * @return the lexer, or NULL if it could not be allocated
  */
 JSONSL_API
 jsonsl_t jsonsl_new(int nlevels);
@@ -574,7 +567,8 @@ void jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes);
 /**
  * Resets the internal parser state. This does not free the parser
  * but does clean it internally, so that the next time feed() is called,
- * it will be treated as a new stream
+ * it will be treated as a new stream. Only the levels used since the
+ * last reset are cleared.
  *
  * @param jsn the lexer
  */
@@ -678,6 +672,29 @@ char jsonsl_get_escape_equiv(unsigned char c);
 JSONSL_API
 int jsonsl_is_allowed_escape(unsigned char c);
 
+/**
+ * Decodes the escapes of a string's contents into UTF-8. Unlike
+ * jsonsl_util_unescape_ex, every escape is decoded and a \uXXXX escape
+ * becomes the UTF-8 encoding of its code point; a surrogate pair becomes
+ * one four-byte sequence and a lone surrogate U+FFFD.
+ *
+ * @param in The contents of the string, without its quotes
+ * @param out A buffer of at least len bytes; the output is never longer
+ * than the input
+ * @param len The size of the input
+ * @param err Set to JSONSL_ERROR_SUCCESS, or the error found
+ * @param errat If not null and an error occurs, set to the position
+ * within the input at which it was found
+ *
+ * @return The size of the output.
+ */
+JSONSL_API
+size_t jsonsl_util_unescape_utf8(const char *in,
+                                 char *out,
+                                 size_t len,
+                                 jsonsl_error_t *err,
+                                 const char **errat);
+
 
 /* This macro just here for editors to do code folding */
 #ifndef JSONSL_NO_JPR
@@ -692,10 +709,8 @@ int jsonsl_is_allowed_escape(unsigned char c);
  *
  * See http://tools.ietf.org/html/draft-pbryan-zyp-json-pointer-00
  *
- * Currently I'm implementing the 'single query' API which can only use a single
- * query component. In the future I will integrate my yet-to-be-published
- * Boyer-Moore-esque prefix searching implementation, in order to allow
- * multiple paths to be merged into one for quick and efficient searching.
+ * Several paths can be matched at once with jsonsl_jpr_match_state(); they
+ * are merged into one prefix automaton for quick and efficient searching.
  *
  *
  * JPR (as we'll refer to it within the source) can be used by splitting
@@ -835,9 +850,9 @@ jsonsl_jpr_match_t jsonsl_jpr_match(jsonsl_jpr_t jpr,
  * After using this function, you may subsequently call match_state() on
  * given states (presumably from within the callbacks).
  *
- * Note that currently the first JPR is the quickest and comes
- * pre-allocated with the state structure. Further JPR objects
- * are chained.
+ * The JPRs are compiled into a single automaton, so the cost of matching
+ * an element does not grow with the number of JPRs. The lexer keeps
+ * pointers to the JPR objects; they must outlive the matching.
  *
  * @param jsn The lexer
  * @param jprs An array of jsonsl_jpr_t objects
@@ -876,6 +891,21 @@ jsonsl_jpr_t jsonsl_jpr_match_state(jsonsl_t jsn,
                                     jsonsl_jpr_match_t *out);
 
 
+/**
+ * Get every JPR which completes at the given state, as positions in the
+ * array passed to match_state_init(). Only valid once match_state() has
+ * been called on the state.
+ *
+ * @param jsn The lexer
+ * @param state The state passed to match_state()
+ * @param indices Set to the positions of the matching JPRs
+ * @return the number of matching JPRs
+ */
+JSONSL_API
+size_t jsonsl_jpr_match_state_complete(jsonsl_t jsn,
+                                       struct jsonsl_state_st *state,
+                                       const size_t **indices);
+
 /**
  * Cleanup any memory allocated and any states set by
  * match_state_init() and match_state()
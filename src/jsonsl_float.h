@@ -0,0 +1,17 @@
+/*
+ * jsonsl_float.h - number to double conversion for JSONSL for mruby
+ *
+ */
+#ifndef JSONSL_FLOAT_H_
+#define JSONSL_FLOAT_H_
+
+#include <stddef.h>
+
+/*
+ * Converts the JSON number in buf[0..len) to the double strtod would
+ * return, without allocating. Returns 0 if buf is not a JSON number or
+ * is too long to convert here, in which case *out is unchanged.
+ */
+int jsonsl_parse_double(const char *buf, size_t len, double *out);
+
+#endif /* JSONSL_FLOAT_H_ */
@@ -5,373 +5,2241 @@
 #include "mruby/hash.h"
 #include "mruby/value.h"
 #include "mruby/string.h"
+#include "mruby/error.h"
+#include "mruby/version.h"
+
+#if !defined(MRB_JSONSL_NO_FD) && (defined(__unix__) || defined(__APPLE__))
+#define MRB_JSONSL_USE_FD
+#include <unistd.h>
+#include <errno.h>
+#endif
 
 #include "jsonsl.h"
+#include "jsonsl_float.h"
 #include "mruby-jsonsl.h"
 
-const static struct mrb_data_type mrb_jsonsl_type = {
-  "JSONSL",
-  mrb_mruby_jsonsl_free,
-};
+const static struct mrb_data_type mrb_jsonsl_type = {
+  "JSONSL",
+  mrb_mruby_jsonsl_free,
+};
+
+const static struct mrb_data_type mrb_jsonsl_doc_type = {
+  "JSONSL::Document",
+  mrb_jsonsl_doc_free,
+};
+
+static int MAX_DESCENT_LEVEL = 20;
+static int DEFAULT_MAX_JSON_SIZE = 0x100;
+static size_t MIN_CARRY_CAPA = 0x40;
+static int DEFAULT_CHUNK_SIZE = 0x4000;
+static size_t MIN_INDEX_CAPA = 0x40;
+static size_t MIN_KEY_CACHE_CAPA = 0x40;
+static size_t MAX_CACHED_KEYS = 0x1000;
+static size_t MAX_CACHED_KEY_LEN = 0x80;
+static mrb_int MAX_POOLED_PARSERS = 4;
+
+static inline struct RClass *
+get_jsonsl_error(mrb_state *mrb)
+{
+  return mrb_class_get_under(mrb, mrb_class_get(mrb, "JSONSL"), "Error");
+}
+
+/*
+ * Errors found from inside jsonsl_feed() are recorded and the lexer is
+ * stopped; they are raised once jsonsl_feed() has returned, so that no
+ * longjmp passes through the lexer.
+ */
+static void
+set_parse_error(jsonsl_t jsn, jsonsl_error_t err, size_t pos, const char *msg)
+{
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+
+  if (data->error == JSONSL_ERROR_SUCCESS) {
+    data->error = err;
+    data->error_pos = pos;
+    data->error_msg = msg;
+  }
+  jsonsl_stop(jsn);
+}
+
+/* Forgets the children of the containers left open by an interrupted document. */
+static void
+release_open_containers(mrb_state *mrb, jsonsl_t jsn)
+{
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+
+  mrb_ary_clear(mrb, data->stack);
+}
+
+static void
+raise_parse_error(mrb_state *mrb, jsonsl_t jsn, size_t pos_offset)
+{
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+  jsonsl_error_t err = data->error;
+
+  release_open_containers(mrb, jsn);
+  data->error = JSONSL_ERROR_SUCCESS;
+  if (err == JSONSL_ERROR_GENERIC) {
+    mrb_raise(mrb, get_jsonsl_error(mrb), data->error_msg);
+  }
+  mrb_raisef(mrb, get_jsonsl_error(mrb), "%S at %S: %S",
+             mrb_str_new_cstr(mrb, data->error_msg),
+             mrb_fixnum_value((mrb_int)(data->error_pos + pos_offset)),
+             mrb_str_new_cstr(mrb, jsonsl_strerror(err)));
+}
+
+/*
+ * Keeps the bytes of the token which is still open at the end of a chunk.
+ * The lexer only remembers where the token began (state->pos_begin), so
+ * the bytes fed in earlier chunks would be lost otherwise.
+ */
+static void
+append_carry(mrb_state *mrb, mrb_jsonsl_data *data, const char *buf, size_t len)
+{
+  size_t capa = data->carry_capa;
+
+  if (data->carry_len + len > capa) {
+    if (capa < MIN_CARRY_CAPA) {
+      capa = MIN_CARRY_CAPA;
+    }
+    while (capa < data->carry_len + len) {
+      capa *= 2;
+    }
+    data->carry = (char *)mrb_realloc(mrb, data->carry, capa);
+    data->carry_capa = capa;
+  }
+  memcpy(data->carry + data->carry_len, buf, len);
+  data->carry_len += len;
+}
+
+static void
+save_partial_token(mrb_state *mrb, jsonsl_t jsn, const char *end)
+{
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+  struct jsonsl_state_st *state = jsn->stack + jsn->level;
+  const char *buf;
+
+  if (jsn->level == 0 ||
+      !((state->type & JSONSL_Tf_STRINGY) || state->type == JSONSL_T_SPECIAL)) {
+    /* containers are built from their children; no bytes needed */
+    data->carry_len = 0;
+    return;
+  }
+  if (state->pos_begin >= data->chunk_pos) {
+    /* token began in this chunk */
+    data->carry_len = 0;
+    buf = jsn->base + (state->pos_begin - data->chunk_pos);
+  } else {
+    /* token spans the whole chunk */
+    buf = jsn->base;
+  }
+  append_carry(mrb, data, buf, end - buf);
+}
+
+/*
+ * Returns the bytes of the token ending at `at`, which may have begun
+ * in an earlier chunk.
+ */
+static const char *
+token_begin(jsonsl_t jsn, struct jsonsl_state_st *state, const char *at, size_t *len)
+{
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+  const char *buf;
+
+  if (state->pos_begin >= data->chunk_pos) {
+    buf = jsn->base + (state->pos_begin - data->chunk_pos);
+    *len = at - buf;
+    return buf;
+  }
+  append_carry(data->mrb, data, jsn->base, at - jsn->base);
+  *len = data->carry_len;
+  return data->carry;
+}
+
+static mrb_bool
+check_toplevel(jsonsl_t jsn, struct jsonsl_state_st *state)
+{
+  if (state->level == 1 &&
+      ((state->type != JSONSL_T_LIST) && (state->type != JSONSL_T_OBJECT))) {
+    set_parse_error(jsn, JSONSL_ERROR_GENERIC, jsn->pos, "Toplevel element should be Hash or List");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void
+create_new_element(jsonsl_t jsn,
+                   jsonsl_action_t action,
+                   struct jsonsl_state_st *state,
+                   const char *buf)
+{
+  if (!check_toplevel(jsn, state)) {
+    return;
+  }
+
+  /* values are built when they are closed, containers from their children */
+  switch(state->type) {
+  case JSONSL_T_SPECIAL:
+  case JSONSL_T_STRING:
+  case JSONSL_T_HKEY:
+  case JSONSL_T_LIST:
+  case JSONSL_T_OBJECT:
+    break;
+  default:
+    set_parse_error(jsn, JSONSL_ERROR_GENERIC, jsn->pos, "Unhandled type");
+    break;
+  }
+}
+
+/*
+ * Converts an integer from the value the lexer accumulated from its
+ * digits (JSONSL_NUMERIC_VALUE), without going through a String.
+ * Returns undef if the digits overflowed or it does not fit in mrb_int.
+ */
+static mrb_value
+integer_value(unsigned int special_flags, uint64_t num)
+{
+  if (special_flags & JSONSL_SPECIALf_OVERFLOW) {
+    return mrb_undef_value();
+  }
+  if (special_flags & JSONSL_SPECIALf_SIGNED) {
+    if (num <= (uint64_t)MRB_INT_MAX) {
+      return mrb_fixnum_value(-(mrb_int)num);
+    }
+    if (num == (uint64_t)MRB_INT_MAX + 1) {
+      return mrb_fixnum_value(MRB_INT_MIN);
+    }
+  } else if (num <= (uint64_t)MRB_INT_MAX) {
+    return mrb_fixnum_value((mrb_int)num);
+  }
+  return mrb_undef_value();
+}
+
+/*
+ * Returns the Symbol for a key as the symbol_key option asks, or undef if
+ * the key stays a String. With :existing or a list of Symbols no Symbol
+ * is created, so input cannot grow the symbol table.
+ */
+static mrb_value
+key_symbol(mrb_state *mrb, mrb_value symbol_key, const char *name, size_t len)
+{
+  mrb_value sym;
+  mrb_int i;
+
+  if (!mrb_symbol_p(symbol_key) && !mrb_array_p(symbol_key)) {
+    return mrb_symbol_value(mrb_intern(mrb, name, len));
+  }
+  sym = mrb_check_intern(mrb, name, len);
+  if (mrb_nil_p(sym)) {
+    return mrb_undef_value();
+  }
+  if (mrb_array_p(symbol_key)) {
+    for (i = 0; i < RARRAY_LEN(symbol_key); i++) {
+      if (mrb_symbol(RARRAY_PTR(symbol_key)[i]) == mrb_symbol(sym)) {
+        return sym;
+      }
+    }
+    return mrb_undef_value();
+  }
+  return sym;
+}
+
+/*
+ * Converts the bytes of a string, key or special (number, true, false,
+ * null) token into a value. `num` is the state's nelem, and `escaped`
+ * whether a string or key has escapes. Strings and keys start with their
+ * opening quote. Returns undef and sets *errp and *errpos if the token is
+ * malformed.
+ */
+static mrb_value
+token_value(mrb_state *mrb, unsigned int type, unsigned int special_flags,
+            uint64_t num, mrb_bool escaped, mrb_value symbol_key,
+            const char *buf, size_t len, size_t pos,
+            jsonsl_error_t *errp, mrb_int *errpos)
+{
+  mrb_value elem;
+  mrb_value temp_str;
+  mrb_value sym;
+  double d;
+
+  switch(type) {
+  case JSONSL_T_SPECIAL:
+    /* Integer, Float or true/false/null */
+    if (special_flags & JSONSL_SPECIALf_NUMNOINT) {
+      if (jsonsl_parse_double(buf, len, &d)) {
+        elem = mrb_float_value(mrb, (mrb_float)d);
+      } else {
+        temp_str = mrb_str_new(mrb, buf, len);
+        elem = mrb_float_value(mrb, mrb_str_to_dbl(mrb, temp_str, TRUE));
+      }
+    } else if (special_flags & JSONSL_SPECIALf_NUMERIC) {
+      elem = integer_value(special_flags, num);
+      if (mrb_undef_p(elem)) {
+        temp_str = mrb_str_new(mrb, buf, len);
+        elem = mrb_str_to_inum(mrb, temp_str, 10, TRUE);
+      }
+    } else if (special_flags & JSONSL_SPECIALf_TRUE) {
+      elem = mrb_true_value();
+    } else if (special_flags & JSONSL_SPECIALf_FALSE) {
+      elem = mrb_false_value();
+    } else if (special_flags & JSONSL_SPECIALf_NULL) {
+      elem = mrb_nil_value();
+    } else {
+      *errp = JSONSL_ERROR_GENERIC;
+      *errpos = (mrb_int)pos;
+      return mrb_undef_value();
+    }
+    break;
+  case JSONSL_T_STRING:
+    /* String */
+    elem = mrb_str_unescaped_utf8(mrb, buf+1, len - 1, escaped, pos+1, errp, errpos);
+    break;
+  case JSONSL_T_HKEY:
+    /* String as key of Hash, or Symbol with symbol_key */
+    if (mrb_test(symbol_key) && !escaped) {
+      elem = key_symbol(mrb, symbol_key, buf + 1, len - 1);
+      if (mrb_undef_p(elem)) {
+        elem = mrb_str_new(mrb, buf + 1, len - 1);
+      }
+      break;
+    }
+    elem = mrb_str_unescaped_utf8(mrb, buf+1, len - 1, escaped, pos+1, errp, errpos);
+    if (mrb_test(symbol_key) && !mrb_undef_p(elem)) {
+      /* escaped keys are interned by their unescaped name */
+      sym = key_symbol(mrb, symbol_key, RSTRING_PTR(elem), RSTRING_LEN(elem));
+      if (!mrb_undef_p(sym)) {
+        elem = sym;
+      }
+    }
+    break;
+  default:
+    *errp = JSONSL_ERROR_GENERIC;
+    *errpos = (mrb_int)pos;
+    return mrb_undef_value();
+  }
+  return elem;
+}
+
+static uint32_t
+key_hash(const char *buf, size_t len)
+{
+  uint32_t h = 2166136261U;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)buf[i]) * 16777619U;
+  }
+  return h;
+}
+
+static void
+key_cache_insert(mrb_jsonsl_key_cache *cache, uint32_t h, uint32_t idx)
+{
+  size_t mask = cache->capa - 1, i;
+
+  for (i = h & mask; cache->slots[i]; i = (i + 1) & mask)
+    ;
+  cache->slots[i] = idx;
+  cache->hashes[i] = h;
+}
+
+/* The key a cached value stands for. */
+static const char *
+cached_name(mrb_state *mrb, mrb_value value, mrb_int *len)
+{
+  if (mrb_symbol_p(value)) {
+    return mrb_sym2name_len(mrb, mrb_symbol(value), len);
+  }
+  *len = RSTRING_LEN(value);
+  return RSTRING_PTR(value);
+}
+
+/* Cached Strings are frozen and shared only with dedup_keys. */
+static mrb_value
+cached_value(mrb_state *mrb, mrb_jsonsl_data *data, mrb_value value)
+{
+  if (mrb_string_p(value) && !data->dedup_keys) {
+    return mrb_str_dup(mrb, value);
+  }
+  return value;
+}
+
+/*
+ * Returns the value of a key without escapes, a Symbol with symbol_key
+ * or else a String. Both are looked up by the key's bytes in a cache kept
+ * by the parser across parses, so a repeated key is interned or checked
+ * against the symbol_key list only once. Once MAX_CACHED_KEYS keys are
+ * cached, new keys are converted every time.
+ */
+static mrb_value
+cached_key(mrb_state *mrb, mrb_jsonsl_data *data, const char *buf, size_t len)
+{
+  mrb_jsonsl_key_cache *cache = data->key_cache;
+  uint32_t h = key_hash(buf, len);
+  size_t mask, i, n, capa;
+  uint32_t *slots, *hashes;
+  mrb_value value;
+  const char *name;
+  mrb_int nlen;
+
+  if (cache->capa) {
+    mask = cache->capa - 1;
+    for (i = h & mask; cache->slots[i]; i = (i + 1) & mask) {
+      if (cache->hashes[i] == h) {
+        value = mrb_ary_ref(mrb, cache->values, cache->slots[i] - 1);
+        name = cached_name(mrb, value, &nlen);
+        if ((size_t)nlen == len && memcmp(name, buf, len) == 0) {
+          return cached_value(mrb, data, value);
+        }
+      }
+    }
+  }
+
+  value = mrb_undef_value();
+  if (mrb_test(data->symbol_key)) {
+    value = key_symbol(mrb, data->symbol_key, buf, len);
+  }
+  if (mrb_undef_p(value)) {
+    value = mrb_str_new(mrb, buf, len);
+  }
+  n = (size_t)RARRAY_LEN(cache->values);
+  if (len > MAX_CACHED_KEY_LEN || n >= MAX_CACHED_KEYS) {
+    return value;
+  }
+#ifdef MRB_SET_FROZEN_FLAG
+  if (mrb_string_p(value)) {
+    /* mrb_hash_set takes frozen String keys without copying them */
+    MRB_SET_FROZEN_FLAG(mrb_basic_ptr(value));
+  }
+#endif
+  if ((n + 1) * 2 > cache->capa) {
+    /* keep the table at most half full */
+    capa = cache->capa ? cache->capa * 2 : MIN_KEY_CACHE_CAPA;
+    slots = (uint32_t *)mrb_calloc(mrb, capa, sizeof(uint32_t));
+    hashes = (uint32_t *)mrb_malloc(mrb, capa * sizeof(uint32_t));
+    for (i = 0; i < cache->capa; i++) {
+      if (cache->slots[i]) {
+        size_t j;
+        for (j = cache->hashes[i] & (capa - 1); slots[j]; j = (j + 1) & (capa - 1))
+          ;
+        slots[j] = cache->slots[i];
+        hashes[j] = cache->hashes[i];
+      }
+    }
+    mrb_free(mrb, cache->slots);
+    mrb_free(mrb, cache->hashes);
+    cache->slots = slots;
+    cache->hashes = hashes;
+    cache->capa = capa;
+  }
+  mrb_ary_push(mrb, cache->values, value);
+  key_cache_insert(cache, h, (uint32_t)(n + 1));
+  return cached_value(mrb, data, value);
+}
+
+/*
+ * Returns a String of `len` bytes at `buf` within `source` which shares
+ * its buffer. Before mrb_str_byte_subseq (mruby 2.1), mrb_str_substr
+ * counts characters instead of bytes in MRB_UTF8_STRING builds, which
+ * then copy the bytes instead.
+ */
+static mrb_value
+source_substr(mrb_state *mrb, mrb_value source, const char *buf, size_t len)
+{
+  mrb_int beg = (mrb_int)(buf - RSTRING_PTR(source));
+
+#if MRUBY_RELEASE_NO >= 20100
+  return mrb_str_byte_subseq(mrb, source, beg, (mrb_int)len);
+#elif defined(MRB_UTF8_STRING)
+  return mrb_str_new(mrb, buf, len);
+#else
+  return mrb_str_substr(mrb, source, beg, (mrb_int)len);
+#endif
+}
+
+static void
+release_key_cache(mrb_state *mrb, mrb_jsonsl_key_cache *cache)
+{
+  if (cache) {
+    mrb_free(mrb, cache->slots);
+    mrb_free(mrb, cache->hashes);
+    mrb_free(mrb, cache);
+  }
+}
+
+/*
+ * Builds the value of a string, key or special (number, true, false,
+ * null) which has just been closed at `at`. Returns undef after
+ * recording the error if the value is malformed.
+ */
+static mrb_value
+scalar_value(jsonsl_t jsn, struct jsonsl_state_st *state, const char *at)
+{
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+  mrb_state *mrb = (mrb_state *)data->mrb;
+
+  mrb_value elem;
+  const char *buf;
+  size_t len;
+  jsonsl_error_t err;
+  mrb_int err_pos;
+
+  if (state->type != JSONSL_T_SPECIAL && !(state->type & JSONSL_Tf_STRINGY)) {
+    set_parse_error(jsn, JSONSL_ERROR_GENERIC, jsn->pos, "Unknown value");
+    return mrb_undef_value();
+  }
+  buf = token_begin(jsn, state, at, &len);
+  if (state->type == JSONSL_T_HKEY && state->nescapes == 0 &&
+      (data->dedup_keys || mrb_test(data->symbol_key))) {
+    return cached_key(mrb, data, buf + 1, len - 1);
+  }
+  if (mrb_string_p(data->source) && (state->type & JSONSL_Tf_STRINGY) &&
+      state->nescapes == 0) {
+    /* JSONSL#parse feeds its input whole, so the token lies within it */
+    return source_substr(mrb, data->source, buf + 1, len - 1);
+  }
+  elem = token_value(mrb, state->type, state->special_flags, state->nelem,
+                     state->nescapes != 0, data->symbol_key, buf, len,
+                     state->pos_begin, &err, &err_pos);
+  if (mrb_undef_p(elem)) {
+    if (err == JSONSL_ERROR_GENERIC) {
+      set_parse_error(jsn, err, jsn->pos, "Invalid special value");
+    } else {
+      set_parse_error(jsn, err, (size_t)err_pos, "escape error");
+    }
+  }
+  return elem;
+}
+
+/*
+ * Builds the Array or Hash closed by `state` in one go from its
+ * children, which are the last JSONSL_LIST_SIZE values, or keys and
+ * values of JSONSL_OBJECT_SIZE pairs, on data->stack, and drops them.
+ */
+static mrb_value
+build_container(jsonsl_t jsn, struct jsonsl_state_st *state)
+{
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+  mrb_state *mrb = (mrb_state *)data->mrb;
+  mrb_int len = RARRAY_LEN(data->stack);
+  mrb_int n = 0, i;
+  const mrb_value *children;
+  mrb_value value;
+
+  /* no callbacks, and no values, below max_callback_level */
+  if (state->level + 1 < jsn->max_callback_level) {
+    n = (mrb_int)state->nelem;
+  }
+  mrb_assert(n <= len);
+  children = RARRAY_PTR(data->stack) + len - n;
+  if (state->type == JSONSL_T_LIST) {
+    value = mrb_ary_new_from_values(mrb, n, children);
+  } else {
+    value = mrb_hash_new_capa(mrb, n / 2);
+    for (i = 0; i + 1 < n; i += 2) {
+      mrb_hash_set(mrb, value, children[i], children[i + 1]);
+    }
+  }
+  mrb_ary_resize(mrb, data->stack, len - n);
+  return value;
+}
+
+/*
+ * Takes the value of the element which is being closed at `at`.
+ * Returns undef after recording the error if it is malformed.
+ */
+static mrb_value
+closing_value(jsonsl_t jsn, struct jsonsl_state_st *state, const char *at)
+{
+  mrb_value elem;
+
+  if (JSONSL_STATE_IS_CONTAINER(state)) {
+    elem = build_container(jsn, state);
+  } else {
+    elem = scalar_value(jsn, state, at);
+  }
+  return elem;
+}
+
+/*
+ * Adds a closed element to its parent container, that is, pushes it on
+ * data->stack until the parent is closed.
+ */
+static void
+add_element(jsonsl_t jsn, struct jsonsl_state_st *state, mrb_value elem)
+{
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+  mrb_state *mrb = (mrb_state *)data->mrb;
+  struct jsonsl_state_st *last_state = jsonsl_last_state(jsn, state);
+
+  if (!last_state) {
+    data->result = elem;
+    /* its children are gone; it stays reachable until it is handed over */
+    mrb_assert(RARRAY_LEN(data->stack) <= 1);
+    mrb_ary_set(mrb, data->stack, 0, elem);
+    if (jsn->options.allow_multiple_values) {
+      /* hand the value over before the lexer goes on */
+      jsonsl_stop(jsn);
+    }
+  } else if (JSONSL_STATE_IS_CONTAINER(last_state)) {
+    mrb_ary_push(mrb, data->stack, elem);
+  } else {
+    set_parse_error(jsn, JSONSL_ERROR_GENERIC, jsn->pos, "Requested to add to non-container parent type!");
+  }
+}
+
+static void
+cleanup_closing_element(jsonsl_t jsn,
+                        jsonsl_action_t action,
+                        struct jsonsl_state_st *state,
+                        const char *at)
+{
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+  int ai = mrb_gc_arena_save(data->mrb);
+  mrb_value elem;
+
+  mrb_assert(state);
+
+  elem = closing_value(jsn, state, at);
+  if (!mrb_undef_p(elem)) {
+    add_element(jsn, state, elem);
+  }
+  /* the element is reachable from data->stack now */
+  mrb_gc_arena_restore(data->mrb, ai);
+}
+
+/*
+ * Event (SAX) mode: instead of building a tree, the PUSH/POP callbacks
+ * call start_object/end_object/start_array/end_array/key/value on a
+ * handler. With a batch size, events are collected as a flat list of
+ * event name and argument pairs and handed over with handler.events(list).
+ */
+static void
+emit_event(jsonsl_t jsn, const char *name, mrb_value arg, mrb_bool has_arg)
+{
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+  mrb_state *mrb = (mrb_state *)data->mrb;
+
+  if (data->batch > 0) {
+    mrb_ary_push(mrb, data->events, mrb_symbol_value(mrb_intern_cstr(mrb, name)));
+    mrb_ary_push(mrb, data->events, arg);
+    if (RARRAY_LEN(data->events) >= data->batch * 2) {
+      mrb_funcall(mrb, data->handler, "events", 1, data->events);
+      data->events = mrb_ary_new_capa(mrb, data->batch * 2);
+      mrb_iv_set(mrb, data->self, mrb_intern_lit(mrb, "__events__"), data->events);
+    }
+  } else if (has_arg) {
+    mrb_funcall(mrb, data->handler, name, 1, arg);
+  } else {
+    mrb_funcall(mrb, data->handler, name, 0);
+  }
+  /* nothing is kept between events */
+  mrb_gc_arena_restore(mrb, data->ai);
+}
+
+static void
+push_event(jsonsl_t jsn,
+           jsonsl_action_t action,
+           struct jsonsl_state_st *state,
+           const char *at)
+{
+  if (state->type == JSONSL_T_OBJECT) {
+    emit_event(jsn, "start_object", mrb_nil_value(), FALSE);
+  } else if (state->type == JSONSL_T_LIST) {
+    emit_event(jsn, "start_array", mrb_nil_value(), FALSE);
+  }
+}
+
+static void
+pop_event(jsonsl_t jsn,
+          jsonsl_action_t action,
+          struct jsonsl_state_st *state,
+          const char *at)
+{
+  mrb_value elem;
+
+  if (state->type == JSONSL_T_OBJECT) {
+    emit_event(jsn, "end_object", mrb_nil_value(), FALSE);
+  } else if (state->type == JSONSL_T_LIST) {
+    emit_event(jsn, "end_array", mrb_nil_value(), FALSE);
+  } else {
+    elem = scalar_value(jsn, state, at);
+    if (mrb_undef_p(elem)) {
+      return;
+    }
+    emit_event(jsn, state->type == JSONSL_T_HKEY ? "key" : "value", elem, TRUE);
+  }
+}
+
+/*
+ * JSON Pointer matching: only the subtrees matched by one of the
+ * pointers are built; the lexer skips the callbacks of everything else
+ * with ignore_callback.
+ */
+static void
+save_key(jsonsl_t jsn, struct jsonsl_state_st *state, const char *at)
+{
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+  const char *buf = jsn->base;
+  size_t len = 0, total;
+
+  if (state->pos_begin >= data->chunk_pos) {
+    buf = jsn->base + (state->pos_begin - data->chunk_pos);
+  } else {
+    /* the key began in an earlier chunk; it is in the carry buffer */
+    len = data->carry_len;
+  }
+  total = len + (at - buf);
+  if (total > data->key_capa) {
+    data->key = (char *)mrb_realloc(data->mrb, data->key, total);
+    data->key_capa = total;
+  }
+  if (len) {
+    memcpy(data->key, data->carry, len);
+  }
+  memcpy(data->key + len, buf, at - buf);
+  data->key_len = total;
+}
+
+static void
+match_found(jsonsl_t jsn, size_t index, mrb_value elem)
+{
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+  mrb_state *mrb = (mrb_state *)data->mrb;
+  mrb_value path, list;
+  mrb_value args[2];
+
+  path = mrb_ary_ref(mrb, data->paths, (mrb_int)index);
+  if (mrb_nil_p(data->matches)) {
+    /* JSONSL#each_match: hand the value over and forget it */
+    args[0] = elem;
+    args[1] = path;
+    mrb_yield_argv(mrb, data->blk, 2, args);
+    if (!data->capture_level) {
+      mrb_gc_arena_restore(mrb, data->ai);
+    }
+    return;
+  }
+  list = mrb_hash_get(mrb, data->matches, path);
+  if (mrb_array_p(list)) {
+    /* pointer with a wildcard */
+    mrb_ary_push(mrb, list, elem);
+  } else {
+    mrb_hash_set(mrb, data->matches, path, elem);
+  }
+}
+
+static void
+push_match(jsonsl_t jsn,
+           jsonsl_action_t action,
+           struct jsonsl_state_st *state,
+           const char *at)
+{
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+  jsonsl_jpr_t jpr = NULL;
+  jsonsl_jpr_match_t match = JSONSL_MATCH_NOMATCH;
+
+  if (!check_toplevel(jsn, state)) {
+    return;
+  }
+  if (state->type != JSONSL_T_HKEY) {
+    /* the key was saved when it was popped; skip the opening quote */
+    jpr = jsonsl_jpr_match_state(jsn, state,
+                                 data->key_len ? data->key + 1 : NULL,
+                                 data->key_len ? data->key_len - 1 : 0,
+                                 &match);
+  }
+  if (jpr && !data->capture_level) {
+    data->capture_level = state->level;
+  }
+
+  if (data->capture_level) {
+    create_new_element(jsn, action, state, at);
+  } else if (state->type != JSONSL_T_HKEY &&
+             !(match == JSONSL_MATCH_POSSIBLE && JSONSL_STATE_IS_CONTAINER(state))) {
+    state->ignore_callback = 1;
+  }
+}
+
+static void
+pop_match(jsonsl_t jsn,
+          jsonsl_action_t action,
+          struct jsonsl_state_st *state,
+          const char *at)
+{
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+  const size_t *indices;
+  size_t ii, n = 0;
+  mrb_value elem;
+
+  if (state->type == JSONSL_T_HKEY) {
+    save_key(jsn, state, at);
+  } else {
+    n = jsonsl_jpr_match_state_complete(jsn, state, &indices);
+  }
+  if (!data->capture_level) {
+    return;
+  }
+
+  elem = closing_value(jsn, state, at);
+  if (mrb_undef_p(elem)) {
+    return;
+  }
+  if (state->level > data->capture_level) {
+    /* inside a matched subtree, which may hold further matches */
+    add_element(jsn, state, elem);
+  } else {
+    data->capture_level = 0;
+  }
+  /* a value may be matched by several pointers */
+  for (ii = 0; ii < n; ii++) {
+    match_found(jsn, indices[ii], elem);
+  }
+}
+/*
+ * Lazy documents: a single pass of the lexer records every node in
+ * document order with its type and byte range. A container's children
+ * follow it, and `next` is the node after its subtree, so siblings can
+ * be walked without looking at their contents.
+ */
+static void
+push_index(jsonsl_t jsn,
+           jsonsl_action_t action,
+           struct jsonsl_state_st *state,
+           const char *at)
+{
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+  mrb_jsonsl_index *index = data->index;
+  mrb_jsonsl_node *node;
+  size_t capa;
+
+  if (!check_toplevel(jsn, state)) {
+    return;
+  }
+  if (index->nnodes == UINT32_MAX) {
+    set_parse_error(jsn, JSONSL_ERROR_GENERIC, jsn->pos, "Too many nodes");
+    return;
+  }
+  if (index->nnodes == index->capa) {
+    capa = index->capa < MIN_INDEX_CAPA ? MIN_INDEX_CAPA : index->capa * 2;
+    index->nodes = (mrb_jsonsl_node *)mrb_realloc(data->mrb, index->nodes,
+                                                  sizeof(mrb_jsonsl_node) * capa);
+    index->capa = capa;
+  }
+  data->open_nodes[state->level] = index->nnodes;
+  node = index->nodes + index->nnodes++;
+  node->pos_begin = state->pos_begin;
+  node->type = (uint32_t)state->type;
+}
+
+static void
+pop_index(jsonsl_t jsn,
+          jsonsl_action_t action,
+          struct jsonsl_state_st *state,
+          const char *at)
+{
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+  mrb_jsonsl_index *index = data->index;
+  mrb_jsonsl_node *node = index->nodes + data->open_nodes[state->level];
+
+  node->pos_end = jsn->pos;
+  node->special_flags = (uint16_t)state->special_flags;
+  node->escaped = (state->type & JSONSL_Tf_STRINGY) && state->nescapes != 0;
+  node->nelem = (state->type & JSONSL_Tf_STRINGY) ? 0 : state->nelem;
+  node->next = (uint32_t)index->nnodes;
+}
+
+
+/*
+ * Builds the String of a string or key body. A body the lexer found no
+ * escapes in is copied as it is; otherwise the escapes are decoded
+ * straight into the new String, which is never longer than the body.
+ */
+static mrb_value
+mrb_str_unescaped_utf8(mrb_state *mrb,
+                       const char *in,
+                       size_t len,
+                       mrb_bool escaped,
+                       mrb_int pos_begin,
+                       jsonsl_error_t *errp,
+                       mrb_int *errpos)
+{
+  mrb_value str;
+  const char *errat;
+  size_t n;
+
+  if (!escaped) {
+    return mrb_str_new(mrb, in, len);
+  }
+  str = mrb_str_buf_new(mrb, len);
+  n = jsonsl_util_unescape_utf8(in, RSTRING_PTR(str), len, errp, &errat);
+  if (*errp != JSONSL_ERROR_SUCCESS) {
+    *errpos = pos_begin + (mrb_int)(errat - in);
+    return mrb_undef_value();
+  }
+  return mrb_str_resize(mrb, str, (mrb_int)n);
+}
+
+int error_callback(jsonsl_t jsn,
+                    jsonsl_error_t err,
+                    struct jsonsl_state_st *state,
+                    char *at)
+{
+  set_parse_error(jsn, err, jsn->pos, "Got error");
+
+  /* do not retry */
+  return 0;
+}
+
+
+/*
+ * Checks the symbol_key option: true or false, :existing to use only
+ * Symbols that already exist, or an Array of the Symbols (or Strings)
+ * that keys may become.
+ */
+static mrb_value
+symbol_key_option(mrb_state *mrb, mrb_value val)
+{
+  mrb_value list, elem;
+  mrb_int i;
+
+  if (mrb_symbol_p(val)) {
+    if (mrb_symbol(val) != mrb_intern_lit(mrb, "existing")) {
+      mrb_raise(mrb, get_jsonsl_error(mrb), "symbol_key should be true, false, :existing or Array");
+    }
+    return val;
+  }
+  if (!mrb_array_p(val)) {
+    return mrb_bool_value(mrb_test(val));
+  }
+  list = mrb_ary_new_capa(mrb, RARRAY_LEN(val));
+  for (i = 0; i < RARRAY_LEN(val); i++) {
+    elem = RARRAY_PTR(val)[i];
+    if (mrb_string_p(elem)) {
+      elem = mrb_symbol_value(mrb_intern(mrb, RSTRING_PTR(elem), RSTRING_LEN(elem)));
+    } else if (!mrb_symbol_p(elem)) {
+      mrb_raise(mrb, get_jsonsl_error(mrb), "symbol_key list should have Symbols");
+    }
+    mrb_ary_push(mrb, list, elem);
+  }
+  return list;
+}
+
+/* Whether keys cached for symbol_key `a` are right for `b`. */
+static mrb_bool
+same_symbol_key(mrb_value a, mrb_value b)
+{
+  mrb_int i;
+
+  if (!mrb_array_p(a) || !mrb_array_p(b)) {
+    /* :existing is never the same: Symbols may have been made since */
+    return mrb_type(a) == mrb_type(b) && !mrb_symbol_p(a);
+  }
+  if (RARRAY_LEN(a) != RARRAY_LEN(b)) {
+    return FALSE;
+  }
+  for (i = 0; i < RARRAY_LEN(a); i++) {
+    if (mrb_symbol(RARRAY_PTR(a)[i]) != mrb_symbol(RARRAY_PTR(b)[i])) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+static void
+set_parse_options(mrb_state *mrb, mrb_value self, mrb_jsonsl_data *data, mrb_value obj, mrb_bool opt)
+{
+  mrb_jsonsl_key_cache *cache = data->key_cache;
+  mrb_value symbol_key;
+
+  data->symbol_key = mrb_false_value();
+  data->dedup_keys = FALSE;
+  data->shared_strings = FALSE;
+  data->source = mrb_nil_value();
+  if (!opt || mrb_nil_p(obj)) {
+    return;
+  }
+  if (mrb_type(obj) != MRB_TT_HASH) {
+    mrb_raise(mrb, get_jsonsl_error(mrb), "Option should be Hash");
+  }
+  symbol_key = symbol_key_option(mrb, mrb_hash_get(mrb, obj, mrb_symbol_value(mrb_intern_lit(mrb, "symbol_key"))));
+  if (mrb_bool(mrb_hash_get(mrb, obj, mrb_symbol_value(mrb_intern_lit(mrb, "dedup_keys"))))) {
+    data->dedup_keys = TRUE;
+  }
+  if (mrb_bool(mrb_hash_get(mrb, obj, mrb_symbol_value(mrb_intern_lit(mrb, "shared_strings"))))) {
+    data->shared_strings = TRUE;
+  }
+  if (!data->dedup_keys && !mrb_test(symbol_key)) {
+    return;
+  }
+  if (!cache) {
+    /* the cache stays with the parser for later parses */
+    cache = (mrb_jsonsl_key_cache *)mrb_malloc(mrb, sizeof(mrb_jsonsl_key_cache));
+    cache->slots = NULL;
+    cache->hashes = NULL;
+    cache->capa = 0;
+    cache->values = mrb_nil_value();
+    cache->symbol_key = symbol_key;
+    data->key_cache = cache;
+  }
+  if (mrb_nil_p(cache->values) || !same_symbol_key(cache->symbol_key, symbol_key)) {
+    mrb_free(mrb, cache->slots);
+    mrb_free(mrb, cache->hashes);
+    cache->slots = NULL;
+    cache->hashes = NULL;
+    cache->capa = 0;
+    cache->values = mrb_ary_new(mrb);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "__keys__"), cache->values);
+  }
+  cache->symbol_key = symbol_key;
+  data->symbol_key = symbol_key;
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "__symbol_key__"), symbol_key);
+}
+
+/* Sets the callbacks which build values, as JSONSL#parse uses them. */
+static void
+set_build_callbacks(jsonsl_t jsn)
+{
+  jsn->action_callback_PUSH = create_new_element;
+  jsn->action_callback_POP = cleanup_closing_element;
+  jsn->max_callback_level = MAX_DESCENT_LEVEL;
+}
+
+static void
+begin_document(jsonsl_t jsn)
+{
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+
+  release_open_containers(data->mrb, jsn);
+  release_pointers(data->mrb, jsn);
+  /* left over if building an index was interrupted */
+  release_index(data->mrb, data->index);
+  data->index = NULL;
+  jsonsl_reset(jsn);
+
+  /* initialize jsn->data */
+  data->result = mrb_undef_value();
+  data->error = JSONSL_ERROR_SUCCESS;
+  data->chunk_pos = 0;
+  data->carry_len = 0;
+
+  /* initalize callbacks */
+  jsonsl_enable_all_callbacks(jsn);
+  jsn->action_callback = NULL;
+  set_build_callbacks(jsn);
+  jsn->error_callback = error_callback;
+  jsn->options.allow_multiple_values = 0;
+}
+
+static void
+feed_chunk(mrb_state *mrb, jsonsl_t jsn, const char *str, size_t len)
+{
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+
+  data->chunk_pos = jsn->pos;
+  jsonsl_feed(jsn, str, len);
+  save_partial_token(mrb, jsn, str + len);
+}
+
+/*
+ * Hands over the value of a finished document. data->stack lets go of
+ * it, so that a parser kept for later does not keep it alive.
+ */
+static mrb_value
+take_result(mrb_state *mrb, mrb_jsonsl_data *data)
+{
+  mrb_ary_clear(mrb, data->stack);
+  mrb_gc_protect(mrb, data->result);
+  return data->result;
+}
+
+static mrb_value
+parse_string(mrb_state *mrb, mrb_value self, mrb_value src, mrb_value obj, mrb_bool opt)
+{
+  jsonsl_t jsn;
+  mrb_jsonsl_data *data;
+
+  /* get jsonsl and reset it */
+  jsn = DATA_PTR(self);
+  data = (mrb_jsonsl_data *)jsn->data;
+  data->in_feed = FALSE;
+  begin_document(jsn);
+  set_parse_options(mrb, self, data, obj, opt);
+  if (data->shared_strings) {
+    /*
+     * Strings are cut from a copy sharing the input's buffer. Sharing it
+     * now keeps its address fixed while it is parsed, and later changes
+     * to the input copy the buffer instead of changing the values.
+     */
+    src = mrb_str_dup(mrb, src);
+    data->source = src;
+  }
+
+  /* do parse */
+  feed_chunk(mrb, jsn, RSTRING_PTR(src), RSTRING_LEN(src));
+  data->source = mrb_nil_value();
+  if (data->error) {
+    raise_parse_error(mrb, jsn, 0);
+  }
+  if (jsn->level != 0) {
+    mrb_raise(mrb, get_jsonsl_error(mrb), "JSON data is terminated");
+  }
+
+  /* return result of parsing */
+  return take_result(mrb, data);
+}
+
+static mrb_value
+mrb_jsonsl_parse(mrb_state *mrb, mrb_value self)
+{
+  mrb_value src;
+  mrb_value obj;
+  mrb_bool opt;
+
+  mrb_get_args(mrb, "S|o?", &src, &obj, &opt);
+
+  return parse_string(mrb, self, src, obj, opt);
+}
+
+/*
+ * JSONSL.parse takes a parser from the pool in JSONSL's @__pool__, set
+ * up by mrb_mruby_jsonsl_gem_init, and puts it back afterwards, so that
+ * parsing small messages does not pay for a new parser each time. A
+ * parser whose parse raised is left to the GC.
+ */
+static mrb_value
+mrb_jsonsl_s_parse(mrb_state *mrb, mrb_value klass)
+{
+  mrb_value src, obj, pool, parser, result;
+  mrb_bool opt;
+
+  mrb_get_args(mrb, "S|o?", &src, &obj, &opt);
+
+  /* subclasses have no pool */
+  pool = mrb_iv_get(mrb, klass, mrb_intern_lit(mrb, "__pool__"));
+  parser = mrb_array_p(pool) ? mrb_ary_pop(mrb, pool) : mrb_nil_value();
+  if (mrb_nil_p(parser)) {
+    parser = mrb_obj_new(mrb, mrb_class_ptr(klass), 0, NULL);
+  }
+  result = parse_string(mrb, parser, src, obj, opt);
+  if (mrb_array_p(pool) && RARRAY_LEN(pool) < MAX_POOLED_PARSERS) {
+    mrb_ary_push(mrb, pool, parser);
+  }
+  return result;
+}
+
+static mrb_value
+mrb_jsonsl_feed(mrb_state *mrb, mrb_value self)
+{
+  char *str;
+  mrb_int len;
+  jsonsl_t jsn;
+  mrb_jsonsl_data *data;
+  mrb_value obj;
+  mrb_bool opt;
+
+  mrb_get_args(mrb, "s|o?", &str, &len, &obj, &opt);
+
+  jsn = DATA_PTR(self);
+  data = (mrb_jsonsl_data *)jsn->data;
+  if (!data->in_feed) {
+    /* first chunk of a new document */
+    begin_document(jsn);
+    set_parse_options(mrb, self, data, obj, opt);
+  }
+
+  /* an error raised while feeding leaves the document unfinished;
+   * the next chunk will then start a new one */
+  data->in_feed = FALSE;
+  feed_chunk(mrb, jsn, str, len);
+  if (data->error) {
+    raise_parse_error(mrb, jsn, 0);
+  }
+  data->in_feed = TRUE;
+
+  return self;
+}
+
+static mrb_value
+mrb_jsonsl_finish(mrb_state *mrb, mrb_value self)
+{
+  jsonsl_t jsn = DATA_PTR(self);
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+  mrb_bool in_feed = data->in_feed;
+
+  data->in_feed = FALSE;
+  if (!in_feed || jsn->level != 0 || mrb_undef_p(data->result)) {
+    mrb_raise(mrb, get_jsonsl_error(mrb), "JSON data is terminated");
+  }
+
+  return take_result(mrb, data);
+}
+
+static mrb_int
+get_chunk_size(mrb_state *mrb, mrb_value obj, mrb_bool opt)
+{
+  mrb_value size;
+
+  if (!opt || !mrb_hash_p(obj)) {
+    return DEFAULT_CHUNK_SIZE;
+  }
+  size = mrb_hash_get(mrb, obj, mrb_symbol_value(mrb_intern_lit(mrb, "chunk_size")));
+  if (mrb_nil_p(size)) {
+    return DEFAULT_CHUNK_SIZE;
+  }
+  if (!mrb_fixnum_p(size) || mrb_fixnum(size) <= 0) {
+    mrb_raise(mrb, get_jsonsl_error(mrb), "chunk_size should be positive Integer");
+  }
+  return mrb_fixnum(size);
+}
+
+#ifdef MRB_JSONSL_USE_FD
+/*
+ * Reads the document from a file descriptor chunk by chunk, reusing
+ * one buffer for every read(2).
+ */
+static mrb_value
+mrb_jsonsl_parse_fd(mrb_state *mrb, mrb_value self)
+{
+  mrb_int fd;
+  mrb_int chunk_size;
+  ssize_t n;
+  jsonsl_t jsn;
+  mrb_jsonsl_data *data;
+  mrb_value buf;
+  mrb_value obj;
+  mrb_bool opt;
+
+  mrb_get_args(mrb, "i|o?", &fd, &obj, &opt);
+
+  jsn = DATA_PTR(self);
+  data = (mrb_jsonsl_data *)jsn->data;
+  data->in_feed = FALSE;
+  begin_document(jsn);
+  set_parse_options(mrb, self, data, obj, opt);
+  chunk_size = get_chunk_size(mrb, obj, opt);
+
+  /* a String, so that the buffer is not leaked when parsing raises */
+  buf = mrb_str_buf_new(mrb, chunk_size);
+  for (;;) {
+    n = read((int)fd, RSTRING_PTR(buf), (size_t)chunk_size);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      mrb_raisef(mrb, get_jsonsl_error(mrb), "read error: %S",
+                 mrb_str_new_cstr(mrb, strerror(errno)));
+    }
+    if (n == 0) {
+      break;
+    }
+    feed_chunk(mrb, jsn, RSTRING_PTR(buf), (size_t)n);
+    if (data->error) {
+      raise_parse_error(mrb, jsn, 0);
+    }
+  }
+  if (jsn->level != 0 || mrb_undef_p(data->result)) {
+    mrb_raise(mrb, get_jsonsl_error(mrb), "JSON data is terminated");
+  }
+
+  return take_result(mrb, data);
+}
+#endif
+
+/*
+ * Reads the next chunk of an IO-like source into buf with
+ * source.read(chunk_size, buf). Returns nil at the end of input.
+ */
+static mrb_value
+read_source_chunk(mrb_state *mrb, mrb_value src, mrb_int chunk_size, mrb_value buf)
+{
+  mrb_value chunk = mrb_funcall(mrb, src, "read", 2, mrb_fixnum_value(chunk_size), buf);
+
+  if (!mrb_nil_p(chunk) && !mrb_string_p(chunk)) {
+    mrb_raise(mrb, get_jsonsl_error(mrb), "read should return String or nil");
+  }
+  return chunk;
+}
+
+/*
+ * Reads the document from an IO-like source with
+ * source.read(chunk_size, buf) until it returns nil.
+ */
+static mrb_value
+mrb_jsonsl_parse_io(mrb_state *mrb, mrb_value self)
+{
+  jsonsl_t jsn;
+  mrb_jsonsl_data *data;
+  mrb_value src, obj;
+  mrb_value buf, chunk;
+  mrb_bool opt;
+  mrb_int chunk_size;
+  int ai;
+
+  mrb_get_args(mrb, "o|o?", &src, &obj, &opt);
+
+  jsn = DATA_PTR(self);
+  data = (mrb_jsonsl_data *)jsn->data;
+  data->in_feed = FALSE;
+  begin_document(jsn);
+  set_parse_options(mrb, self, data, obj, opt);
+  chunk_size = get_chunk_size(mrb, obj, opt);
+
+  buf = mrb_str_buf_new(mrb, chunk_size);
+  ai = mrb_gc_arena_save(mrb);
+  while (!mrb_nil_p(chunk = read_source_chunk(mrb, src, chunk_size, buf))) {
+    /* feed what read returned; it need not be buf */
+    feed_chunk(mrb, jsn, RSTRING_PTR(chunk), RSTRING_LEN(chunk));
+    if (data->error) {
+      raise_parse_error(mrb, jsn, 0);
+    }
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  if (jsn->level != 0 || mrb_undef_p(data->result)) {
+    mrb_raise(mrb, get_jsonsl_error(mrb), "JSON data is terminated");
+  }
+
+  return take_result(mrb, data);
+}
+
+typedef struct record_reader {
+  mrb_value self;
+  mrb_value blk;
+  mrb_value skipped;    /* offsets of malformed records */
+  mrb_bool skip_invalid;
+  mrb_bool bad;         /* current record is malformed */
+  size_t pos;           /* stream offset of the next byte to read */
+  size_t record_pos;    /* stream offset of the current record */
+  int ai;
+} record_reader;
+
+static void
+reject_record(mrb_state *mrb, jsonsl_t jsn, record_reader *rd)
+{
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+
+  if (!rd->skip_invalid) {
+    raise_parse_error(mrb, jsn, rd->record_pos);
+  }
+  data->error = JSONSL_ERROR_SUCCESS;
+  release_open_containers(mrb, jsn);
+  mrb_ary_push(mrb, rd->skipped, mrb_fixnum_value((mrb_int)rd->record_pos));
+  rd->bad = TRUE;
+}
+
+static void
+end_record(mrb_state *mrb, jsonsl_t jsn, record_reader *rd)
+{
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+
+  if (!rd->bad) {
+    if (jsn->level != 0) {
+      set_parse_error(jsn, JSONSL_ERROR_GENERIC, jsn->pos, "JSON data is terminated");
+      reject_record(mrb, jsn, rd);
+    } else if (!mrb_undef_p(data->result)) {
+      mrb_yield(mrb, rd->blk, data->result);
+    }
+    /* else: blank line */
+  }
+
+  /* only the parser is reused for the next record */
+  begin_document(jsn);
+  rd->bad = FALSE;
+  rd->record_pos = rd->pos;
+  mrb_gc_arena_restore(mrb, rd->ai);
+}
+
+static void
+feed_records(mrb_state *mrb, jsonsl_t jsn, record_reader *rd, const char *str, size_t len)
+{
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+  const char *end = str + len;
+  const char *nl;
+
+  while (str < end) {
+    nl = (const char *)memchr(str, '\n', end - str);
+    if (!rd->bad) {
+      feed_chunk(mrb, jsn, str, (nl ? nl : end) - str);
+      if (data->error) {
+        reject_record(mrb, jsn, rd);
+      }
+    }
+    if (!nl) {
+      rd->pos += end - str;
+      break;
+    }
+    rd->pos += nl + 1 - str;
+    str = nl + 1;
+    end_record(mrb, jsn, rd);
+  }
+}
+
+/*
+ * Parses newline-delimited JSON (JSON Lines) from a String or an IO and
+ * yields each record. One parser is reused for all the records.
+ * With {:skip_invalid => true}, malformed records are skipped; the byte
+ * offsets where they begin are returned.
+ */
+static mrb_value
+mrb_jsonsl_each_record(mrb_state *mrb, mrb_value self)
+{
+  jsonsl_t jsn;
+  mrb_jsonsl_data *data;
+  mrb_value src, obj, blk;
+  mrb_value buf, chunk;
+  mrb_bool opt;
+  mrb_int chunk_size;
+  record_reader rd;
+
+  mrb_get_args(mrb, "o|o?&", &src, &obj, &opt, &blk);
+  if (mrb_nil_p(blk)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+  }
+
+  jsn = DATA_PTR(self);
+  data = (mrb_jsonsl_data *)jsn->data;
+  data->in_feed = FALSE;
+  begin_document(jsn);
+  set_parse_options(mrb, self, data, obj, opt);
+  chunk_size = get_chunk_size(mrb, obj, opt);
+
+  rd.self = self;
+  rd.blk = blk;
+  rd.skipped = mrb_ary_new(mrb);
+  rd.skip_invalid = opt && mrb_hash_p(obj) &&
+    mrb_test(mrb_hash_get(mrb, obj, mrb_symbol_value(mrb_intern_lit(mrb, "skip_invalid"))));
+  rd.bad = FALSE;
+  rd.pos = 0;
+  rd.record_pos = 0;
+  rd.ai = mrb_gc_arena_save(mrb);
+
+  if (mrb_string_p(src)) {
+    feed_records(mrb, jsn, &rd, RSTRING_PTR(src), RSTRING_LEN(src));
+  } else {
+    buf = mrb_str_buf_new(mrb, chunk_size);
+    rd.ai = mrb_gc_arena_save(mrb);
+    while (!mrb_nil_p(chunk = read_source_chunk(mrb, src, chunk_size, buf))) {
+      feed_records(mrb, jsn, &rd, RSTRING_PTR(chunk), RSTRING_LEN(chunk));
+    }
+  }
+  /* the last record may lack its newline */
+  end_record(mrb, jsn, &rd);
+
+  return rd.skipped;
+}
+
+/*
+ * Feeds a chunk of concatenated values. The lexer stops on the closing
+ * bracket of each top-level value; the value is yielded and feeding
+ * resumes from the next byte.
+ */
+static void
+feed_values(mrb_state *mrb, jsonsl_t jsn, mrb_value blk, const char *str, size_t len, int ai)
+{
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+  mrb_value value;
+  size_t consumed;
+
+  for (;;) {
+    feed_chunk(mrb, jsn, str, len);
+    if (data->error) {
+      raise_parse_error(mrb, jsn, 0);
+    }
+    if (!jsn->stopfl) {
+      break;
+    }
+    consumed = jsn->pos - data->chunk_pos + 1;
+    jsn->stopfl = 0;
+    jsn->pos++;
+    value = data->result;
+    data->result = mrb_undef_value();
+    mrb_yield(mrb, blk, value);
+    mrb_gc_arena_restore(mrb, ai);
+    str += consumed;
+    len -= consumed;
+  }
+}
+
+/*
+ * Parses a stream of top-level values which follow each other without
+ * separators ({..}{..}[..]), or separated by whitespace or RFC 7464
+ * record separators, from a String or an IO, and yields each value.
+ */
+static mrb_value
+mrb_jsonsl_each_value(mrb_state *mrb, mrb_value self)
+{
+  jsonsl_t jsn;
+  mrb_jsonsl_data *data;
+  mrb_value src, obj, blk;
+  mrb_value buf, chunk;
+  mrb_bool opt;
+  mrb_int chunk_size;
+  int ai;
+
+  mrb_get_args(mrb, "o|o?&", &src, &obj, &opt, &blk);
+  if (mrb_nil_p(blk)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+  }
+
+  jsn = DATA_PTR(self);
+  data = (mrb_jsonsl_data *)jsn->data;
+  data->in_feed = FALSE;
+  begin_document(jsn);
+  set_parse_options(mrb, self, data, obj, opt);
+  chunk_size = get_chunk_size(mrb, obj, opt);
+  jsn->options.allow_multiple_values = 1;
+
+  if (mrb_string_p(src)) {
+    ai = mrb_gc_arena_save(mrb);
+    feed_values(mrb, jsn, blk, RSTRING_PTR(src), RSTRING_LEN(src), ai);
+  } else {
+    buf = mrb_str_buf_new(mrb, chunk_size);
+    ai = mrb_gc_arena_save(mrb);
+    while (!mrb_nil_p(chunk = read_source_chunk(mrb, src, chunk_size, buf))) {
+      feed_values(mrb, jsn, blk, RSTRING_PTR(chunk), RSTRING_LEN(chunk), ai);
+    }
+  }
+  if (jsn->level != 0) {
+    mrb_raise(mrb, get_jsonsl_error(mrb), "JSON data is terminated");
+  }
+
+  return self;
+}
+
+/*
+ * Feeds the document of JSONSL#parse_events, run under mrb_ensure, as
+ * the handler is called from inside jsonsl_feed() and may raise.
+ * `args` is [self, source, chunk size].
+ */
+static mrb_value
+parse_events_body(mrb_state *mrb, mrb_value args)
+{
+  mrb_value self = mrb_ary_ref(mrb, args, 0);
+  mrb_value src = mrb_ary_ref(mrb, args, 1);
+  mrb_int chunk_size = mrb_fixnum(mrb_ary_ref(mrb, args, 2));
+  jsonsl_t jsn = DATA_PTR(self);
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+  mrb_value buf, chunk;
+
+  if (mrb_string_p(src)) {
+    data->ai = mrb_gc_arena_save(mrb);
+    feed_chunk(mrb, jsn, RSTRING_PTR(src), RSTRING_LEN(src));
+  } else {
+    buf = mrb_str_buf_new(mrb, chunk_size);
+    data->ai = mrb_gc_arena_save(mrb);
+    while (!data->error &&
+           !mrb_nil_p(chunk = read_source_chunk(mrb, src, chunk_size, buf))) {
+      feed_chunk(mrb, jsn, RSTRING_PTR(chunk), RSTRING_LEN(chunk));
+      mrb_gc_arena_restore(mrb, data->ai);
+    }
+  }
+  if (data->error) {
+    raise_parse_error(mrb, jsn, 0);
+  }
+  if (jsn->level != 0) {
+    mrb_raise(mrb, get_jsonsl_error(mrb), "JSON data is terminated");
+  }
+  if (data->batch > 0 && RARRAY_LEN(data->events) > 0) {
+    mrb_funcall(mrb, data->handler, "events", 1, data->events);
+  }
+  return data->handler;
+}
+
+/* Takes the handler and the event callbacks off the parser. */
+static mrb_value
+end_events(mrb_state *mrb, mrb_value self)
+{
+  jsonsl_t jsn = DATA_PTR(self);
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+
+  data->self = mrb_nil_value();
+  data->handler = mrb_nil_value();
+  data->events = mrb_nil_value();
+  data->batch = 0;
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "__events__"), mrb_nil_value());
+  set_build_callbacks(jsn);
+  return mrb_nil_value();
+}
+
+/*
+ * Parses a String or an IO and reports it to a handler as events
+ * instead of building the result. With {:batch => n}, events are
+ * delivered n at a time through handler.events(list).
+ */
+static mrb_value
+mrb_jsonsl_parse_events(mrb_state *mrb, mrb_value self)
+{
+  jsonsl_t jsn;
+  mrb_jsonsl_data *data;
+  mrb_value src, handler, obj;
+  mrb_value batch, args[3];
+  mrb_bool opt;
+  mrb_int chunk_size;
+
+  mrb_get_args(mrb, "oo|o?", &src, &handler, &obj, &opt);
+
+  jsn = DATA_PTR(self);
+  data = (mrb_jsonsl_data *)jsn->data;
+  data->in_feed = FALSE;
+  begin_document(jsn);
+  set_parse_options(mrb, self, data, obj, opt);
+  chunk_size = get_chunk_size(mrb, obj, opt);
+  jsn->action_callback_PUSH = push_event;
+  jsn->action_callback_POP = pop_event;
+  jsn->max_callback_level = jsn->levels_max;
+
+  data->self = self;
+  data->handler = handler;
+  data->batch = 0;
+  if (opt && mrb_hash_p(obj)) {
+    batch = mrb_hash_get(mrb, obj, mrb_symbol_value(mrb_intern_lit(mrb, "batch")));
+    if (mrb_fixnum_p(batch) && mrb_fixnum(batch) > 0) {
+      data->batch = mrb_fixnum(batch);
+    }
+  }
+  if (data->batch > 0) {
+    data->events = mrb_ary_new_capa(mrb, data->batch * 2);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "__events__"), data->events);
+  }
+
+  args[0] = self;
+  args[1] = src;
+  args[2] = mrb_fixnum_value(chunk_size);
+  return mrb_ensure(mrb, parse_events_body, mrb_ary_new_from_values(mrb, 3, args),
+                    end_events, self);
+}
 
-static int MAX_DESCENT_LEVEL = 20;
-static int DEFAULT_MAX_JSON_SIZE = 0x100;
+static void
+release_pointers(mrb_state *mrb, jsonsl_t jsn)
+{
+  size_t ii;
 
-#define MRB_JSONSL_PENDING_KEY mrb_sym2str(mrb, mrb_intern_lit(mrb, "pending_key"))
+  for (ii = 0; ii < jsn->jpr_count; ii++) {
+    jsonsl_jpr_destroy(jsn->jprs[ii]);
+  }
+  jsonsl_jpr_match_state_cleanup(jsn);
+}
 
-static inline struct RClass *
-get_jsonsl_error(mrb_state *mrb)
+/*
+ * Compiles the JSON Pointers in `paths` and sets the lexer up to match
+ * them. A wildcard component (^) matches every element of a list or
+ * object; the values of such pointers are collected in an Array.
+ */
+static void
+begin_match(mrb_state *mrb, jsonsl_t jsn, mrb_value paths)
 {
-  return mrb_class_get_under(mrb, mrb_class_get(mrb, "JSONSL"), "Error");
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+  jsonsl_jpr_t *jprs;
+  jsonsl_error_t err = JSONSL_ERROR_SUCCESS;
+  mrb_value path;
+  mrb_int ii, jj, n = RARRAY_LEN(paths);
+  int ai;
+
+  for (ii = 0; ii < n; ii++) {
+    path = mrb_ary_ref(mrb, paths, ii);
+    if (!mrb_string_p(path)) {
+      mrb_raise(mrb, get_jsonsl_error(mrb), "JSON Pointer should be String");
+    }
+    if (memchr(RSTRING_PTR(path), '\0', RSTRING_LEN(path))) {
+      mrb_raisef(mrb, get_jsonsl_error(mrb), "invalid JSON Pointer %S: contains NUL", path);
+    }
+  }
+  jprs = (jsonsl_jpr_t *)mrb_malloc(mrb, sizeof(jsonsl_jpr_t) * (n > 0 ? n : 1));
+  ai = mrb_gc_arena_save(mrb);
+  for (ii = 0; ii < n; ii++) {
+    path = mrb_ary_ref(mrb, paths, ii);
+    jprs[ii] = jsonsl_jpr_new(mrb_str_to_cstr(mrb, path), &err);
+    mrb_gc_arena_restore(mrb, ai);
+    if (!jprs[ii]) {
+      for (jj = 0; jj < ii; jj++) {
+        jsonsl_jpr_destroy(jprs[jj]);
+      }
+      mrb_free(mrb, jprs);
+      mrb_raisef(mrb, get_jsonsl_error(mrb), "invalid JSON Pointer %S: %S",
+                 path, mrb_str_new_cstr(mrb, jsonsl_strerror(err)));
+    }
+  }
+  jsonsl_jpr_match_state_init(jsn, jprs, (size_t)n);
+  if (n > 0 && !jsn->jpr_dfa) {
+    for (ii = 0; ii < n; ii++) {
+      jsonsl_jpr_destroy(jprs[ii]);
+    }
+    mrb_free(mrb, jprs);
+    jsonsl_jpr_match_state_cleanup(jsn);
+    mrb_raise(mrb, E_RUNTIME_ERROR, "can't compile JSON Pointers: out of memory");
+  }
+  mrb_free(mrb, jprs);
+
+  data->capture_level = 0;
+  data->key_len = 0;
+  data->paths = paths;
+  jsn->action_callback_PUSH = push_match;
+  jsn->action_callback_POP = pop_match;
+  jsn->max_callback_level = jsn->levels_max;
 }
 
-static inline void
-set_pending_key(mrb_state *mrb, mrb_value hash, mrb_value value)
+static mrb_bool
+has_wildcard(jsonsl_jpr_t jpr)
 {
-  mrb_hash_set(mrb, hash, MRB_JSONSL_PENDING_KEY, value);
+  size_t ii;
+
+  for (ii = 0; ii < jpr->ncomponents; ii++) {
+    if (jpr->components[ii].ptype == JSONSL_PATH_WILDCARD) {
+      return TRUE;
+    }
+  }
+  return FALSE;
 }
 
-static inline void
-remove_pending_key(mrb_state *mrb, mrb_value hash)
+/*
+ * Returns a Hash from each JSON Pointer in `paths` to the value it
+ * points to. Pointers with a wildcard map to the Array of all matched
+ * values; pointers which match nothing are left out.
+ */
+static mrb_value
+mrb_jsonsl_extract(mrb_state *mrb, mrb_value self)
 {
-  mrb_hash_delete_key(mrb, hash, MRB_JSONSL_PENDING_KEY);
+  char *str;
+  mrb_int len;
+  jsonsl_t jsn;
+  mrb_jsonsl_data *data;
+  mrb_value paths, obj, matches;
+  mrb_bool opt;
+  size_t ii;
+
+  mrb_get_args(mrb, "sA|o?", &str, &len, &paths, &obj, &opt);
+
+  jsn = DATA_PTR(self);
+  data = (mrb_jsonsl_data *)jsn->data;
+  data->in_feed = FALSE;
+  begin_document(jsn);
+  set_parse_options(mrb, self, data, obj, opt);
+  begin_match(mrb, jsn, paths);
+
+  matches = mrb_hash_new(mrb);
+  for (ii = 0; ii < jsn->jpr_count; ii++) {
+    if (has_wildcard(jsn->jprs[ii])) {
+      mrb_hash_set(mrb, matches, mrb_ary_ref(mrb, paths, (mrb_int)ii), mrb_ary_new(mrb));
+    }
+  }
+  data->matches = matches;
+
+  feed_chunk(mrb, jsn, str, len);
+  release_pointers(mrb, jsn);
+  data->matches = mrb_nil_value();
+  data->paths = mrb_nil_value();
+  if (data->error) {
+    raise_parse_error(mrb, jsn, 0);
+  }
+  if (jsn->level != 0) {
+    release_open_containers(mrb, jsn);
+    mrb_raise(mrb, get_jsonsl_error(mrb), "JSON data is terminated");
+  }
+
+  return matches;
 }
 
-static inline mrb_value
-get_pending_key(mrb_state *mrb, mrb_value hash)
+/*
+ * Feeds the document of JSONSL#each_match, run under mrb_ensure, as the
+ * block is called from inside jsonsl_feed() and may raise or break.
+ * `args` is [self, source, chunk size].
+ */
+static mrb_value
+each_match_body(mrb_state *mrb, mrb_value args)
 {
-  return mrb_hash_get(mrb, hash, MRB_JSONSL_PENDING_KEY);
+  mrb_value self = mrb_ary_ref(mrb, args, 0);
+  mrb_value src = mrb_ary_ref(mrb, args, 1);
+  mrb_int chunk_size = mrb_fixnum(mrb_ary_ref(mrb, args, 2));
+  jsonsl_t jsn = DATA_PTR(self);
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+  mrb_value buf, chunk;
+
+  if (mrb_string_p(src)) {
+    data->ai = mrb_gc_arena_save(mrb);
+    feed_chunk(mrb, jsn, RSTRING_PTR(src), RSTRING_LEN(src));
+  } else {
+    buf = mrb_str_buf_new(mrb, chunk_size);
+    data->ai = mrb_gc_arena_save(mrb);
+    while (!data->error &&
+           !mrb_nil_p(chunk = read_source_chunk(mrb, src, chunk_size, buf))) {
+      feed_chunk(mrb, jsn, RSTRING_PTR(chunk), RSTRING_LEN(chunk));
+      if (!data->capture_level) {
+        mrb_gc_arena_restore(mrb, data->ai);
+      }
+    }
+  }
+  if (data->error) {
+    raise_parse_error(mrb, jsn, 0);
+  }
+  if (jsn->level != 0) {
+    mrb_raise(mrb, get_jsonsl_error(mrb), "JSON data is terminated");
+  }
+  return self;
 }
 
-static void
-add_to_hash(mrb_state *mrb, mrb_value parent, mrb_value value)
+/*
+ * Takes the compiled pointers, the block and the values of a subtree
+ * being matched off the parser.
+ */
+static mrb_value
+end_each_match(mrb_state *mrb, mrb_value self)
 {
-  mrb_value pending_key = get_pending_key(mrb, parent);
-  mrb_assert(mrb_test(pending_key));
-  mrb_hash_set(mrb, parent, pending_key, value);
-  remove_pending_key(mrb, parent);
+  jsonsl_t jsn = DATA_PTR(self);
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
+
+  release_pointers(mrb, jsn);
+  release_open_containers(mrb, jsn);
+  data->paths = mrb_nil_value();
+  data->blk = mrb_nil_value();
+  data->capture_level = 0;
+  set_build_callbacks(jsn);
+  return mrb_nil_value();
+}
+
+/*
+ * Parses a String or an IO and yields each value matched by the JSON
+ * Pointer (or Array of pointers) together with its pointer, as soon as
+ * the value is closed. Nothing is kept after the block returns, so a
+ * huge top-level array can be walked with "/^" in constant memory.
+ */
+static mrb_value
+mrb_jsonsl_each_match(mrb_state *mrb, mrb_value self)
+{
+  jsonsl_t jsn;
+  mrb_jsonsl_data *data;
+  mrb_value src, paths, obj, blk;
+  mrb_value args[3];
+  mrb_bool opt;
+  mrb_int chunk_size;
+
+  mrb_get_args(mrb, "oo|o?&", &src, &paths, &obj, &opt, &blk);
+  if (mrb_nil_p(blk)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+  }
+  if (mrb_string_p(paths)) {
+    paths = mrb_ary_new_from_values(mrb, 1, &paths);
+  } else if (!mrb_array_p(paths)) {
+    mrb_raise(mrb, get_jsonsl_error(mrb), "JSON Pointer should be String or Array");
+  }
+
+  jsn = DATA_PTR(self);
+  data = (mrb_jsonsl_data *)jsn->data;
+  data->in_feed = FALSE;
+  begin_document(jsn);
+  set_parse_options(mrb, self, data, obj, opt);
+  chunk_size = get_chunk_size(mrb, obj, opt);
+  begin_match(mrb, jsn, paths);
+  data->matches = mrb_nil_value();
+  data->blk = blk;
+
+  args[0] = self;
+  args[1] = src;
+  args[2] = mrb_fixnum_value(chunk_size);
+  return mrb_ensure(mrb, each_match_body, mrb_ary_new_from_values(mrb, 3, args),
+                    end_each_match, self);
 }
 
 static void
-add_to_list(mrb_state *mrb, mrb_value parent, mrb_value value)
+release_index(mrb_state *mrb, mrb_jsonsl_index *index)
 {
-  mrb_ary_push(mrb, parent, value);
+  if (index && --index->refcount <= 0) {
+    mrb_free(mrb, index->nodes);
+    mrb_free(mrb, index);
+  }
 }
 
 static void
-create_new_element(jsonsl_t jsn,
-                   jsonsl_action_t action,
-                   struct jsonsl_state_st *state,
-                   const char *buf)
+mrb_jsonsl_doc_free(mrb_state *mrb, void *ptr)
 {
-  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
-  mrb_state *mrb = (mrb_state *)data->mrb;
+  mrb_jsonsl_doc *doc = (mrb_jsonsl_doc *)ptr;
 
-  if (state->level == 1 &&
-      ((state->type != JSONSL_T_LIST) && (state->type != JSONSL_T_OBJECT))) {
-    mrb_raise(mrb, get_jsonsl_error(mrb), "Toplevel element should be Hash or List");
+  if (doc) {
+    release_index(mrb, doc->index);
+    mrb_free(mrb, doc);
   }
+}
 
-  switch(state->type) {
-  case JSONSL_T_SPECIAL:
-  case JSONSL_T_STRING:
-    break;
-  case JSONSL_T_HKEY:
-    break;
-  case JSONSL_T_LIST:
-    state->data = (mrb_value *)mrb_malloc(mrb, sizeof(mrb_value));
-    *(mrb_value *)(state->data) = mrb_ary_new(mrb);
-    break;
-  case JSONSL_T_OBJECT:
-    state->data = (mrb_value *)mrb_malloc(mrb, sizeof(mrb_value));
-    *(mrb_value *)(state->data) = mrb_hash_new(mrb);
-    break;
-  default:
-    mrb_raisef(mrb, get_jsonsl_error(mrb), "Unhandled type %c\n", state->type);
-    break;
-  }
+/* Wraps the subtree at node `root` of an index in a JSONSL::Document. */
+static mrb_value
+doc_new(mrb_state *mrb, mrb_jsonsl_index *index, size_t root, mrb_value source, mrb_value cache,
+        mrb_value symbol_key)
+{
+  struct RClass *cls = mrb_class_get_under(mrb, mrb_class_get(mrb, "JSONSL"), "Document");
+  mrb_jsonsl_doc *doc = (mrb_jsonsl_doc *)mrb_malloc(mrb, sizeof(mrb_jsonsl_doc));
+  mrb_value obj;
+
+  doc->index = index;
+  doc->root = root;
+  doc->cursor = 0;
+  doc->cursor_node = root + 1;
+  index->refcount++;
+  obj = mrb_obj_value(mrb_data_object_alloc(mrb, cls, doc, &mrb_jsonsl_doc_type));
+  mrb_iv_set(mrb, obj, mrb_intern_lit(mrb, "__source__"), source);
+  mrb_iv_set(mrb, obj, mrb_intern_lit(mrb, "__cache__"), cache);
+  mrb_iv_set(mrb, obj, mrb_intern_lit(mrb, "__symbol_key__"), symbol_key);
+  return obj;
 }
 
 static void
-cleanup_closing_element(jsonsl_t jsn,
-                        jsonsl_action_t action,
-                        struct jsonsl_state_st *state,
-                        const char *at)
+raise_escape_error(mrb_state *mrb, jsonsl_error_t err, mrb_int err_pos)
 {
-  mrb_value *parent;
-  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
-  mrb_state *mrb = (mrb_state *)data->mrb;
+  mrb_raisef(mrb, get_jsonsl_error(mrb), "escape error at %S: %S",
+             mrb_fixnum_value(err_pos), mrb_str_new_cstr(mrb, jsonsl_strerror(err)));
+}
 
+static mrb_value
+node_scalar(mrb_state *mrb, mrb_jsonsl_index *index, mrb_value source, size_t i, mrb_value symbol_key)
+{
+  mrb_jsonsl_node *node = index->nodes + i;
+  jsonsl_error_t err;
+  mrb_int err_pos;
   mrb_value elem;
-  mrb_value temp_str;
-  char *buf;
-  struct jsonsl_state_st *last_state = jsonsl_last_state(jsn, state);
 
-  mrb_assert(state);
+  if (index->shared_strings && (node->type & JSONSL_Tf_STRINGY) &&
+      !node->escaped && !mrb_test(symbol_key)) {
+    return source_substr(mrb, source, RSTRING_PTR(source) + node->pos_begin + 1,
+                         node->pos_end - node->pos_begin - 1);
+  }
+  elem = token_value(mrb, node->type, node->special_flags, node->nelem,
+                     node->escaped, symbol_key, RSTRING_PTR(source) + node->pos_begin,
+                     node->pos_end - node->pos_begin, node->pos_begin,
+                     &err, &err_pos);
+  if (mrb_undef_p(elem)) {
+    raise_escape_error(mrb, err, err_pos);
+  }
+  return elem;
+}
 
-  switch(state->type) {
-  case JSONSL_T_SPECIAL:
-    /* Integer, Float or true/false/null */
-    if (state->special_flags & JSONSL_SPECIALf_NUMNOINT) {
-      buf = (char *)jsn->base + state->pos_begin;
-      temp_str = mrb_str_new(mrb, buf, at - buf);
-      elem = mrb_float_value(mrb, mrb_str_to_dbl(mrb, temp_str, TRUE));
-    } else if (state->special_flags & JSONSL_SPECIALf_NUMERIC) {
-      buf = (char *)jsn->base + state->pos_begin;
-      temp_str = mrb_str_new(mrb, buf, at - buf);
-      elem = mrb_str_to_inum(mrb, temp_str, 10, TRUE);
-    } else if (state->special_flags & JSONSL_SPECIALf_TRUE) {
-      elem = mrb_true_value();
-    } else if (state->special_flags & JSONSL_SPECIALf_FALSE) {
-      elem = mrb_false_value();
-    } else if (state->special_flags & JSONSL_SPECIALf_NULL) {
-      elem = mrb_nil_value();
-    } else {
-      mrb_raise(mrb, get_jsonsl_error(mrb), "Invalid special value");
+/* Builds the whole value of node `i`. */
+static mrb_value
+node_value(mrb_state *mrb, mrb_jsonsl_index *index, mrb_value source, size_t i, mrb_value symbol_key)
+{
+  mrb_jsonsl_node *node = index->nodes + i;
+  mrb_value value, key;
+  size_t c;
+
+  if (node->type == JSONSL_T_LIST) {
+    value = mrb_ary_new_capa(mrb, node->nelem);
+    for (c = i + 1; c < node->next; c = index->nodes[c].next) {
+      mrb_ary_push(mrb, value, node_value(mrb, index, source, c, symbol_key));
     }
-    break;
-  case JSONSL_T_STRING:
-    /* String */
-    buf = (char *)jsn->base + state->pos_begin;
-    elem = mrb_str_unescaped_utf8(mrb, buf+1, at - buf - 1, state->pos_begin+1);
-    break;
-  case JSONSL_T_HKEY:
-    /* String as key of Hash */
-    buf = (char *)jsn->base + state->pos_begin;
-    if (((mrb_jsonsl_data *)jsn->data)->symbol_key) {
-      elem = mrb_symbol_value(mrb_intern(mrb, buf+1, at - buf - 1));
-    } else {
-      elem = mrb_str_unescaped_utf8(mrb, buf+1, at - buf - 1, state->pos_begin+1);
+  } else if (node->type == JSONSL_T_OBJECT) {
+    value = mrb_hash_new_capa(mrb, node->nelem / 2);
+    for (c = i + 1; c < node->next; c = index->nodes[c].next) {
+      key = node_scalar(mrb, index, source, c, symbol_key);
+      c = index->nodes[c].next;
+      mrb_hash_set(mrb, value, key, node_value(mrb, index, source, c, symbol_key));
     }
-    break;
-  case JSONSL_T_LIST:
-  case JSONSL_T_OBJECT:
-    elem = *(mrb_value *)state->data;
-    break;
-  default:
-    mrb_raise(mrb, get_jsonsl_error(mrb), "Unknown value");
+  } else {
+    value = node_scalar(mrb, index, source, i, mrb_false_value());
   }
+  return value;
+}
 
-  if (state->data) {
-    mrb_free(mrb, state->data);
-  }
+/*
+ * Returns the value of node `i` if it is a scalar, or a Document for it
+ * if it is a container. Either is cached.
+ */
+static mrb_value
+doc_child(mrb_state *mrb, mrb_value self, mrb_jsonsl_doc *doc, size_t i)
+{
+  mrb_value source = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "__source__"));
+  mrb_value cache = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "__cache__"));
+  mrb_value key = mrb_fixnum_value((mrb_int)i);
+  mrb_value value = mrb_hash_fetch(mrb, cache, key, mrb_undef_value());
 
-  if (!last_state) {
-    data->result = elem;
-  } else if (last_state->type == JSONSL_T_LIST) {
-    parent = (mrb_value *)last_state->data;
-    mrb_assert(mrb_array_p(*parent));
-    add_to_list(mrb, *parent, elem);
-  } else if (last_state->type == JSONSL_T_OBJECT) {
-    parent = (mrb_value *)last_state->data;
-    mrb_assert((mrb_hash_p(*parent)));
-    /* ignore keys; do add only values */
-    if (state->type == JSONSL_T_HKEY) {
-      set_pending_key(mrb, *parent, elem);
-    } else {
-      add_to_hash(mrb, *parent, elem);
-    }
+  if (!mrb_undef_p(value)) {
+    return value;
+  }
+  if (JSONSL_STATE_IS_CONTAINER((doc->index->nodes + i))) {
+    value = doc_new(mrb, doc->index, i, source, cache,
+                    mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "__symbol_key__")));
   } else {
-    mrb_raise(mrb, get_jsonsl_error(mrb), "Requested to add to non-container parent type!");
+    value = node_scalar(mrb, doc->index, source, i, mrb_false_value());
   }
+  mrb_hash_set(mrb, cache, key, value);
+  return value;
 }
 
+/*
+ * Whether the key node `c` equals `key`. An escaped key is decoded into
+ * `*buf`, a String made once and reused for the keys of one lookup.
+ */
+static mrb_bool
+key_equal(mrb_state *mrb, mrb_jsonsl_index *index, mrb_value source, size_t c,
+          const char *key, size_t len, mrb_value *buf)
+{
+  mrb_jsonsl_node *node = index->nodes + c;
+  const char *body = RSTRING_PTR(source) + node->pos_begin + 1;
+  size_t nbody = node->pos_end - node->pos_begin - 1;
+  jsonsl_error_t err = JSONSL_ERROR_SUCCESS;
+  const char *errat;
 
-static uint32_t
-char2codepoint(char *p, mrb_int *err_pos)
-{
-  uint32_t num = 0;
-  char *ch = p;
-  for (; ch < p + 4; ch++) {
-    num *= 16;
-    if ('0' <= ch[0] && ch[0] <= '9') {
-      num += (int)(ch[0] - '0');
-    } else if ('a' <= ch[0] && ch[0] <= 'f') {
-      num += (int)(ch[0] - 'a' + 10);
-    } else if ('A' <= ch[0] && ch[0] <= 'F') {
-      num += (int)(ch[0] - 'A' + 10);
-    } else {
-      *err_pos = (mrb_int)(ch-p);
-      return 0;
-    }
+  if (!node->escaped) {
+    return nbody == len && memcmp(body, key, len) == 0;
+  }
+  /* decoding never makes a key longer */
+  if (len > nbody) {
+    return FALSE;
+  }
+  if (mrb_nil_p(*buf)) {
+    *buf = mrb_str_buf_new(mrb, nbody);
   }
-  *err_pos = 0;
-  return num;
+  mrb_str_resize(mrb, *buf, (mrb_int)nbody);
+  nbody = jsonsl_util_unescape_utf8(body, RSTRING_PTR(*buf), nbody, &err, &errat);
+  if (err != JSONSL_ERROR_SUCCESS) {
+    raise_escape_error(mrb, err, (mrb_int)node->pos_begin + 1 + (mrb_int)(errat - body));
+  }
+  return nbody == len && memcmp(RSTRING_PTR(*buf), key, len) == 0;
 }
 
-/* from mruby/mrbgems/mruby-string-utf8/src/string.c */
-static size_t
-codepoint2utf8(uint32_t cp, char *utf8)
+/*
+ * Document#[](key) looks up a key (String or Symbol) of an object or an
+ * index of an array. Scalars are returned as values, objects and arrays
+ * as Documents.
+ */
+static mrb_value
+mrb_jsonsl_doc_aref(mrb_state *mrb, mrb_value self)
 {
-  size_t len;
+  mrb_jsonsl_doc *doc = (mrb_jsonsl_doc *)DATA_PTR(self);
+  mrb_jsonsl_index *index = doc->index;
+  mrb_jsonsl_node *node = index->nodes + doc->root;
+  mrb_value key, source, buf;
+  mrb_int n;
+  const char *name;
+  mrb_int len;
+  size_t c, found;
+  int ai;
+
+  mrb_get_args(mrb, "o", &key);
 
-  if (cp < 0x80) {
-    utf8[0] = (char)cp;
-    len = 1;
+  if (node->type == JSONSL_T_LIST) {
+    if (!mrb_fixnum_p(key)) {
+      mrb_raise(mrb, E_TYPE_ERROR, "array index should be Integer");
+    }
+    n = mrb_fixnum(key);
+    if (n < 0) {
+      n += (mrb_int)node->nelem;
+    }
+    if (n < 0 || n >= (mrb_int)node->nelem) {
+      return mrb_nil_value();
+    }
+    /* siblings are only linked forwards; walk on from the last lookup */
+    if (n < doc->cursor) {
+      doc->cursor = 0;
+      doc->cursor_node = doc->root + 1;
+    }
+    for (c = doc->cursor_node; doc->cursor < n; doc->cursor++) {
+      c = index->nodes[c].next;
+    }
+    doc->cursor_node = c;
+    return doc_child(mrb, self, doc, c);
   }
-  else if (cp < 0x800) {
-    utf8[0] = (char)(0xC0 | (cp >> 6));
-    utf8[1] = (char)(0x80 | (cp & 0x3F));
-    len = 2;
+
+  if (mrb_symbol_p(key)) {
+    name = mrb_sym2name_len(mrb, mrb_symbol(key), &len);
+  } else if (mrb_string_p(key)) {
+    name = RSTRING_PTR(key);
+    len = RSTRING_LEN(key);
+  } else {
+    return mrb_nil_value();
   }
-  else if (cp < 0x10000) {
-    utf8[0] = (char)(0xE0 |  (cp >> 12));
-    utf8[1] = (char)(0x80 | ((cp >>  6) & 0x3F));
-    utf8[2] = (char)(0x80 | ( cp        & 0x3F));
-    len = 3;
+  source = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "__source__"));
+  /* the last of duplicate keys wins, as in the Hash of #value */
+  found = 0;
+  buf = mrb_nil_value();
+  ai = mrb_gc_arena_save(mrb);
+  for (c = doc->root + 1; c < node->next; c = index->nodes[c].next) {
+    if (key_equal(mrb, index, source, c, name, (size_t)len, &buf)) {
+      found = index->nodes[c].next;
+    }
+    c = index->nodes[c].next;
   }
-  else {
-    utf8[0] = (char)(0xF0 |  (cp >> 18));
-    utf8[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
-    utf8[2] = (char)(0x80 | ((cp >>  6) & 0x3F));
-    utf8[3] = (char)(0x80 | ( cp        & 0x3F));
-    len = 4;
+  mrb_gc_arena_restore(mrb, ai);
+  if (!found) {
+    return mrb_nil_value();
   }
-  return len;
+  return doc_child(mrb, self, doc, found);
 }
 
+static mrb_value
+mrb_jsonsl_doc_array_p(mrb_state *mrb, mrb_value self)
+{
+  mrb_jsonsl_doc *doc = (mrb_jsonsl_doc *)DATA_PTR(self);
+
+  return mrb_bool_value(doc->index->nodes[doc->root].type == JSONSL_T_LIST);
+}
 
+/*
+ * Returns the keys of an object Document as #value would have them:
+ * duplicate keys are counted once, where they first appear. The Array
+ * is cached in @__keys__.
+ */
 static mrb_value
-mrb_str_unescaped_utf8(mrb_state *mrb,
-                       const char *in,
-                       size_t len,
-                       mrb_int pos_begin)
-{
-  char *ch = (char *)in;
-  char *out;
-  char *origout;
-  char *end = (char *)in + len;
-  size_t origlen = len;
-  size_t ndiff = 0;
-  mrb_int err_pos;
-  char utf8[4];
-  uint32_t codepoint;
-  size_t utf8len;
-
-#define UNESCAPE_ERROR(e,offset)                \
-  mrb_raisef(mrb, get_jsonsl_error(mrb), "escape error at %S: %S", \
-             mrb_fixnum_value(pos_begin+(int)(ch - in + (ptrdiff_t)offset)), \
-             mrb_str_new_cstr(mrb, jsonsl_strerror(JSONSL_ERROR_##e)));
-
-  out = (char *)mrb_malloc(mrb, len+1);
-  origout = out;
-
-  for (; ch < end; ch++, len--) {
-    if (*ch != '\\') {
-      *out = *ch;
-      out++;
-    } else {
-      /* ch[0] == '\\' */
-      if (len < 2) { /* 2 == strlen('\\b') */
-        UNESCAPE_ERROR(ESCAPE_INVALID, 0);
-      }
-      if (!jsonsl_is_allowed_escape(ch[1])) {
-        UNESCAPE_ERROR(ESCAPE_INVALID, 1);
-      }
-      if (ch[1] != 'u') {
-        char esctmp = jsonsl_get_escape_equiv(ch[1]);
-        if (!esctmp) {
-          UNESCAPE_ERROR(ESCAPE_INVALID, 1);
-        }
-        *out = esctmp;
-        out++;
-        ndiff++;
-        continue;
-      }
+doc_key_list(mrb_state *mrb, mrb_value self, mrb_jsonsl_doc *doc)
+{
+  mrb_jsonsl_index *index = doc->index;
+  mrb_jsonsl_node *node = index->nodes + doc->root;
+  mrb_value keys = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "__keys__"));
+  mrb_value source, symbol_key, seen;
+  size_t c;
 
-      /* next == 'u' */
-      if (len < 6) {
-        /* Need at least six characters:
-         * { [0]='\\', [1]='u', [2]='f', [3]='f', [4]='f', [5]='f' }
-         */
-        UNESCAPE_ERROR(UESCAPE_TOOSHORT, -1);
-      }
-      codepoint = char2codepoint(ch+2, &err_pos);
-      if (err_pos) {
-        UNESCAPE_ERROR(UESCAPE_TOOSHORT, -1);
-      }
-      if (0x10FFFF < codepoint) {
-        UNESCAPE_ERROR(ESCAPE_INVALID, -1);
-      }
-      utf8len = codepoint2utf8(codepoint, utf8);
-      len -= 5;
-      ch += 5;
-      memcpy(out, utf8, utf8len);
-      out += utf8len;
-      ndiff += (6 - utf8len);
-    }
+  if (mrb_array_p(keys)) {
+    return keys;
   }
-
-  return mrb_str_new_static(mrb, origout, origlen - ndiff);
+  source = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "__source__"));
+  symbol_key = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "__symbol_key__"));
+  seen = mrb_hash_new_capa(mrb, node->nelem / 2);
+  for (c = doc->root + 1; c < node->next; c = index->nodes[c].next) {
+    mrb_hash_set(mrb, seen, node_scalar(mrb, index, source, c, symbol_key), mrb_true_value());
+    c = index->nodes[c].next;
+  }
+  keys = mrb_hash_keys(mrb, seen);
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "__keys__"), keys);
+  return keys;
 }
 
-int error_callback(jsonsl_t jsn,
-                    jsonsl_error_t err,
-                    struct jsonsl_state_st *state,
-                    char *at)
+static mrb_value
+mrb_jsonsl_doc_size(mrb_state *mrb, mrb_value self)
 {
-  mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
-  mrb_state *mrb = (mrb_state *)data->mrb;
+  mrb_jsonsl_doc *doc = (mrb_jsonsl_doc *)DATA_PTR(self);
+  mrb_jsonsl_node *node = doc->index->nodes + doc->root;
 
-  mrb_raisef(mrb, get_jsonsl_error(mrb),
-             "Got error at %S: %S\n", mrb_fixnum_value(jsn->pos), mrb_str_new_cstr(mrb, jsonsl_strerror(err)));
+  if (node->type == JSONSL_T_OBJECT) {
+    return mrb_fixnum_value(RARRAY_LEN(doc_key_list(mrb, self, doc)));
+  }
+  return mrb_fixnum_value(node->nelem);
+}
 
-  /* do not reach */
-  return 0;
+static mrb_value
+mrb_jsonsl_doc_keys(mrb_state *mrb, mrb_value self)
+{
+  mrb_jsonsl_doc *doc = (mrb_jsonsl_doc *)DATA_PTR(self);
+  mrb_value keys;
+
+  if (doc->index->nodes[doc->root].type != JSONSL_T_OBJECT) {
+    return mrb_ary_new(mrb);
+  }
+  /* a copy, as the caller may change it */
+  keys = doc_key_list(mrb, self, doc);
+  return mrb_ary_new_from_values(mrb, RARRAY_LEN(keys), RARRAY_PTR(keys));
 }
 
+/* Document#value builds (and caches) the whole Hash or Array. */
+static mrb_value
+mrb_jsonsl_doc_value(mrb_state *mrb, mrb_value self)
+{
+  mrb_jsonsl_doc *doc = (mrb_jsonsl_doc *)DATA_PTR(self);
+  mrb_value source = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "__source__"));
+  mrb_value cache = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "__cache__"));
+  /* whole values are cached apart from the Documents of the same nodes */
+  mrb_value key = mrb_fixnum_value(-1 - (mrb_int)doc->root);
+  mrb_value value = mrb_hash_fetch(mrb, cache, key, mrb_undef_value());
+
+  if (mrb_undef_p(value)) {
+    value = node_value(mrb, doc->index, source, doc->root,
+                       mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "__symbol_key__")));
+    mrb_hash_set(mrb, cache, key, value);
+  }
+  return value;
+}
 
+/*
+ * Indexes a String in one pass and returns a JSONSL::Document, which
+ * builds values only for the nodes that are looked up.
+ */
 static mrb_value
-mrb_jsonsl_parse(mrb_state *mrb, mrb_value self)
+mrb_jsonsl_lazy(mrb_state *mrb, mrb_value self)
 {
-  char *str;
-  int len;
   jsonsl_t jsn;
   mrb_jsonsl_data *data;
-  mrb_value obj;
+  mrb_jsonsl_index *index;
+  mrb_value src, obj;
   mrb_bool opt;
-  mrb_value key ;
 
-  mrb_get_args(mrb, "s|o?", &str, &len, &obj, &opt);
+  mrb_get_args(mrb, "S|o?", &src, &obj, &opt);
 
-  /* get jsonsl and reset it */
   jsn = DATA_PTR(self);
-  jsonsl_reset(jsn);
-
-  /* initialize jsn->data */
   data = (mrb_jsonsl_data *)jsn->data;
-  data->result = mrb_undef_value();
-  key = mrb_symbol_value(mrb_intern_lit(mrb, "symbol_key"));
-  if (!opt) {
-    data->symbol_key = FALSE;
-  } else {
-    if (mrb_type(obj) != MRB_TT_HASH) {
-      mrb_raise(mrb, get_jsonsl_error(mrb), "Option should be Hash");
-    } else {
-      if (mrb_bool(mrb_hash_get(mrb, obj, key))) {
-        data->symbol_key = TRUE;
-      } else {
-        data->symbol_key = FALSE;
-      }
-    }
-  }
+  data->in_feed = FALSE;
+  begin_document(jsn);
+  set_parse_options(mrb, self, data, obj, opt);
+  jsn->action_callback_PUSH = push_index;
+  jsn->action_callback_POP = pop_index;
+  jsn->max_callback_level = jsn->levels_max;
 
-  /* initalize callbacks */
-  jsonsl_enable_all_callbacks(jsn);
-  jsn->action_callback = NULL;
-  jsn->action_callback_PUSH = create_new_element;
-  jsn->action_callback_POP = cleanup_closing_element;
-  jsn->error_callback = error_callback;
-  jsn->max_callback_level = MAX_DESCENT_LEVEL;
+  index = (mrb_jsonsl_index *)mrb_malloc(mrb, sizeof(mrb_jsonsl_index));
+  index->nodes = NULL;
+  index->nnodes = 0;
+  index->capa = 0;
+  index->shared_strings = data->shared_strings;
+  index->refcount = 1;
+  data->index = index;
+  data->open_nodes = (size_t *)mrb_malloc(mrb, sizeof(size_t) * jsn->levels_max);
 
-  /* do parse */
-  jsonsl_feed(jsn, str, len);
-  if (jsn->level != 0) {
+  feed_chunk(mrb, jsn, RSTRING_PTR(src), RSTRING_LEN(src));
+  mrb_free(mrb, data->open_nodes);
+  data->open_nodes = NULL;
+  data->index = NULL;
+  if (data->error || jsn->level != 0 || index->nnodes == 0) {
+    release_index(mrb, index);
+    if (data->error) {
+      raise_parse_error(mrb, jsn, 0);
+    }
     mrb_raise(mrb, get_jsonsl_error(mrb), "JSON data is terminated");
   }
 
-  /* return result of parsing */
-  return data->result;
+  /* the index points into the source, which must not change */
+  src = doc_new(mrb, index, 0, mrb_str_dup(mrb, src), mrb_hash_new(mrb), data->symbol_key);
+  release_index(mrb, index);
+  return src;
+}
+
+static mrb_jsonsl_data *
+mrb_jsonsl_data_new(mrb_state *mrb)
+{
+  mrb_jsonsl_data *data = (mrb_jsonsl_data *)mrb_malloc(mrb, sizeof(mrb_jsonsl_data));
+
+  data->mrb = mrb;
+  data->result = mrb_undef_value(); /* result = undef */
+  data->symbol_key = mrb_false_value();
+  data->in_feed = FALSE;
+  data->chunk_pos = 0;
+  data->carry = NULL;
+  data->carry_len = 0;
+  data->carry_capa = 0;
+  data->error = JSONSL_ERROR_SUCCESS;
+  data->error_pos = 0;
+  data->error_msg = NULL;
+  data->self = mrb_nil_value();
+  data->handler = mrb_nil_value();
+  data->events = mrb_nil_value();
+  data->batch = 0;
+  data->ai = 0;
+  data->paths = mrb_nil_value();
+  data->matches = mrb_nil_value();
+  data->blk = mrb_nil_value();
+  data->capture_level = 0;
+  data->key = NULL;
+  data->key_len = 0;
+  data->key_capa = 0;
+  data->index = NULL;
+  data->open_nodes = NULL;
+  data->stack = mrb_nil_value();
+  data->dedup_keys = FALSE;
+  data->key_cache = NULL;
+  data->shared_strings = FALSE;
+  data->source = mrb_nil_value();
+
+  return data;
+}
+
+/* Sets up data->stack, kept reachable from self. */
+static void
+init_stack(mrb_state *mrb, mrb_value self, mrb_jsonsl_data *data)
+{
+  data->stack = mrb_ary_new(mrb);
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "__stack__"), data->stack);
 }
 
 static mrb_value
@@ -381,9 +2249,7 @@ mrb_jsonsl_init(mrb_state *mrb, mrb_value self)
   mrb_int jsonsl_size;
   int n;
 
-  mrb_jsonsl_data *data = (mrb_jsonsl_data *)mrb_malloc(mrb, sizeof(mrb_jsonsl_data));
-  data->mrb = mrb;
-  data->result = mrb_undef_value(); /* result = undef */
+  mrb_jsonsl_data *data = mrb_jsonsl_data_new(mrb);
 
   n = mrb_get_args(mrb, "|i", &jsonsl_size);
   if (n == 0) {
@@ -395,6 +2261,7 @@ mrb_jsonsl_init(mrb_state *mrb, mrb_value self)
   DATA_TYPE(self) = &mrb_jsonsl_type;
   DATA_PTR(self) = jsn;
   jsn->data = data;
+  init_stack(mrb, self, data);
 
   return self;
 }
@@ -415,13 +2282,12 @@ mrb_jsonsl_init_copy(mrb_state *mrb, mrb_value copy)
   if (!DATA_PTR(copy)) {
     jsn_orig = DATA_PTR(src);
     jsonsl_size = jsn_orig->levels_max;
-    data = (mrb_jsonsl_data *)mrb_malloc(mrb, sizeof(mrb_jsonsl_data));
-    data->mrb = mrb;
-    data->result = mrb_undef_value(); /* result = undef */
+    data = mrb_jsonsl_data_new(mrb);
     jsn = jsonsl_new(jsonsl_size); /* jsonsl_new() uses calloc() */
     DATA_TYPE(copy) = &mrb_jsonsl_type;
     DATA_PTR(copy) = jsn;
     jsn->data = data;
+    init_stack(mrb, copy, data);
   }
 
   return copy;
@@ -433,6 +2299,12 @@ mrb_mruby_jsonsl_free(mrb_state *mrb, void *ptr)
   jsonsl_t jsn = (jsonsl_t)ptr;
   mrb_jsonsl_data *data = (mrb_jsonsl_data *)jsn->data;
   if (data) {
+    release_pointers(mrb, jsn);
+    release_index(mrb, data->index);
+    mrb_free(mrb, data->open_nodes);
+    mrb_free(mrb, data->carry);
+    mrb_free(mrb, data->key);
+    release_key_cache(mrb, data->key_cache);
     mrb_free(mrb, data);
   }
   if (jsn) {
@@ -444,14 +2316,40 @@ void
 mrb_mruby_jsonsl_gem_init(mrb_state* mrb)
 {
   struct RClass *jsonsl = mrb_define_class(mrb, "JSONSL", mrb->object_class);
+  struct RClass *document;
   MRB_SET_INSTANCE_TT(jsonsl, MRB_TT_DATA);
 
   /* define "JSON::Error" class for runtime exception */
   mrb_define_class_under(mrb, jsonsl, "Error", E_RUNTIME_ERROR);
 
   mrb_define_method(mrb, jsonsl, "initialize", mrb_jsonsl_init, MRB_ARGS_OPT(1));
+  mrb_define_class_method(mrb, jsonsl, "parse", mrb_jsonsl_s_parse, MRB_ARGS_ARG(1,1));
+  mrb_iv_set(mrb, mrb_obj_value(jsonsl), mrb_intern_lit(mrb, "__pool__"),
+             mrb_ary_new_capa(mrb, MAX_POOLED_PARSERS));
   mrb_define_method(mrb, jsonsl, "parse", mrb_jsonsl_parse, MRB_ARGS_ARG(1,1));
+  mrb_define_method(mrb, jsonsl, "feed", mrb_jsonsl_feed, MRB_ARGS_ARG(1,1));
+  mrb_define_method(mrb, jsonsl, "finish", mrb_jsonsl_finish, MRB_ARGS_NONE());
+  mrb_define_method(mrb, jsonsl, "parse_io", mrb_jsonsl_parse_io, MRB_ARGS_ARG(1,1));
+#ifdef MRB_JSONSL_USE_FD
+  mrb_define_method(mrb, jsonsl, "parse_fd", mrb_jsonsl_parse_fd, MRB_ARGS_ARG(1,1));
+#endif
+  mrb_define_method(mrb, jsonsl, "each_record", mrb_jsonsl_each_record, MRB_ARGS_ARG(1,1)|MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, jsonsl, "each_value", mrb_jsonsl_each_value, MRB_ARGS_ARG(1,1)|MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, jsonsl, "extract", mrb_jsonsl_extract, MRB_ARGS_ARG(2,1));
+  mrb_define_method(mrb, jsonsl, "each_match", mrb_jsonsl_each_match, MRB_ARGS_ARG(2,1)|MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, jsonsl, "parse_events", mrb_jsonsl_parse_events, MRB_ARGS_ARG(2,1));
+  mrb_define_method(mrb, jsonsl, "lazy", mrb_jsonsl_lazy, MRB_ARGS_ARG(1,1));
+  mrb_define_const(mrb, jsonsl, "CHUNK_SIZE", mrb_fixnum_value(DEFAULT_CHUNK_SIZE));
   mrb_define_method(mrb, jsonsl, "initialize_copy", mrb_jsonsl_init_copy, MRB_ARGS_REQ(1));
+
+  document = mrb_define_class_under(mrb, jsonsl, "Document", mrb->object_class);
+  MRB_SET_INSTANCE_TT(document, MRB_TT_DATA);
+  mrb_undef_class_method(mrb, document, "new");
+  mrb_define_method(mrb, document, "[]", mrb_jsonsl_doc_aref, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, document, "size", mrb_jsonsl_doc_size, MRB_ARGS_NONE());
+  mrb_define_method(mrb, document, "array?", mrb_jsonsl_doc_array_p, MRB_ARGS_NONE());
+  mrb_define_method(mrb, document, "keys", mrb_jsonsl_doc_keys, MRB_ARGS_NONE());
+  mrb_define_method(mrb, document, "value", mrb_jsonsl_doc_value, MRB_ARGS_NONE());
 }
 
 void
@@ -5,18 +5,76 @@
 #ifndef MRUBY_JSONSL_H_
 #define MRUBY_JSONSL_H_
 
+/* A node of a lazy document's index, see JSONSL#lazy */
+typedef struct mrb_jsonsl_node {
+  size_t pos_begin;
+  size_t pos_end;     /* closing quote or bracket, or the byte after a special */
+  uint64_t nelem;     /* children of a container (keys and values for objects),
+                         or the value of an integer */
+  uint32_t next;      /* node after this subtree */
+  uint32_t type;      /* jsonsl_type_t */
+  uint16_t special_flags;
+  uint8_t escaped;    /* string or key with escapes */
+} mrb_jsonsl_node;
+
+typedef struct mrb_jsonsl_index {
+  mrb_jsonsl_node *nodes;
+  size_t nnodes;
+  size_t capa;
+  mrb_bool shared_strings;
+  int refcount;       /* Documents sharing the index */
+} mrb_jsonsl_index;
+
+typedef struct mrb_jsonsl_doc {
+  mrb_jsonsl_index *index;
+  size_t root;
+  mrb_int cursor;     /* element of a list last looked up */
+  size_t cursor_node; /* and its node, so that walking on is O(1) */
+} mrb_jsonsl_doc;
+
+/* Key values shared by all parses with dedup_keys or symbol_key */
+typedef struct mrb_jsonsl_key_cache {
+  uint32_t *slots;    /* index + 1 in values, or 0 */
+  uint32_t *hashes;
+  size_t capa;        /* slots, a power of two */
+  mrb_value values;   /* Symbols or frozen Strings, also kept in @__keys__ */
+  mrb_value symbol_key; /* option the values were made for */
+} mrb_jsonsl_key_cache;
+
 typedef struct mrb_jsonsl_data {
   mrb_state *mrb;
   mrb_value result;
-  mrb_bool symbol_key;
+  mrb_value symbol_key; /* true, false, :existing or Array of Symbols */
+  mrb_bool dedup_keys;
+  mrb_bool shared_strings;
+  mrb_value source;   /* input of JSONSL#parse with shared_strings */
+  mrb_bool in_feed;   /* a document is being fed by JSONSL#feed */
+  size_t chunk_pos;   /* stream position of the current chunk (jsn->base) */
+  char *carry;        /* bytes of a token begun in earlier chunks */
+  size_t carry_len;
+  size_t carry_capa;
+  jsonsl_error_t error; /* error found while feeding, raised afterwards */
+  size_t error_pos;
+  const char *error_msg;
+  mrb_value self;
+  mrb_value handler;    /* receives events in JSONSL#parse_events */
+  mrb_value events;     /* batched events */
+  mrb_int batch;
+  int ai;
+  mrb_value paths;      /* JSON Pointers given to JSONSL#extract */
+  mrb_value matches;    /* values found by JSONSL#extract */
+  mrb_value blk;        /* block of JSONSL#each_match */
+  unsigned int capture_level; /* level of the outermost matched subtree */
+  char *key;            /* last key popped, for matching its value */
+  size_t key_len;
+  size_t key_capa;
+  mrb_jsonsl_index *index;  /* index being built by JSONSL#lazy */
+  size_t *open_nodes;   /* index node of each open level */
+  mrb_value stack;      /* values waiting for their container to close,
+                           also kept in @__stack__ */
+  mrb_jsonsl_key_cache *key_cache;
 } mrb_jsonsl_data;
 
-static void
-add_to_hash(mrb_state *mrb, mrb_value parent, mrb_value value);
-
-static void
-add_to_list(mrb_state *mrb, mrb_value parent, mrb_value value);
-
 static void
 create_new_element(jsonsl_t jsn,
                    jsonsl_action_t action,
@@ -29,6 +87,42 @@ cleanup_closing_element(jsonsl_t jsn,
                         struct jsonsl_state_st *state,
                         const char *at);
 
+static void
+push_event(jsonsl_t jsn,
+           jsonsl_action_t action,
+           struct jsonsl_state_st *state,
+           const char *at);
+
+static void
+pop_event(jsonsl_t jsn,
+          jsonsl_action_t action,
+          struct jsonsl_state_st *state,
+          const char *at);
+
+static void
+push_match(jsonsl_t jsn,
+           jsonsl_action_t action,
+           struct jsonsl_state_st *state,
+           const char *at);
+
+static void
+pop_match(jsonsl_t jsn,
+          jsonsl_action_t action,
+          struct jsonsl_state_st *state,
+          const char *at);
+
+static void
+push_index(jsonsl_t jsn,
+           jsonsl_action_t action,
+           struct jsonsl_state_st *state,
+           const char *at);
+
+static void
+pop_index(jsonsl_t jsn,
+          jsonsl_action_t action,
+          struct jsonsl_state_st *state,
+          const char *at);
+
 int
 error_callback(jsonsl_t jsn,
                jsonsl_error_t err,
@@ -39,11 +133,52 @@ static mrb_value
 mrb_str_unescaped_utf8(mrb_state *mrb,
                        const char *in,
                        size_t len,
-                       mrb_int pos_begin);
+                       mrb_bool escaped,
+                       mrb_int pos_begin,
+                       jsonsl_error_t *errp,
+                       mrb_int *errpos);
 
 static mrb_value
 mrb_jsonsl_parse(mrb_state *mrb, mrb_value self);
 
+static mrb_value
+mrb_jsonsl_feed(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+mrb_jsonsl_finish(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+mrb_jsonsl_each_record(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+mrb_jsonsl_each_value(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+mrb_jsonsl_parse_events(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+mrb_jsonsl_extract(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+mrb_jsonsl_each_match(mrb_state *mrb, mrb_value self);
+
+static void
+release_pointers(mrb_state *mrb, jsonsl_t jsn);
+
+static mrb_value
+mrb_jsonsl_lazy(mrb_state *mrb, mrb_value self);
+
+static void
+mrb_jsonsl_doc_free(mrb_state *mrb, void *ptr);
+
+static void
+release_index(mrb_state *mrb, mrb_jsonsl_index *index);
+
+#ifdef MRB_JSONSL_USE_FD
+static mrb_value
+mrb_jsonsl_parse_fd(mrb_state *mrb, mrb_value self);
+#endif
+
 static mrb_value
 mrb_jsonsl_init(mrb_state *mrb, mrb_value self);
 
@@ -0,0 +1,30 @@
+#include "mruby.h"
+#include "mruby/string.h"
+#include "mruby/version.h"
+
+/* Whether `str` points into the buffer of `src`, i.e. shares it */
+static mrb_value
+jsonsl_test_shares_buffer_p(mrb_state *mrb, mrb_value self)
+{
+  mrb_value str, src;
+  const char *ptr;
+
+  mrb_get_args(mrb, "SS", &str, &src);
+  ptr = RSTRING_PTR(str);
+  return mrb_bool_value(ptr >= RSTRING_PTR(src) &&
+                        ptr < RSTRING_PTR(src) + RSTRING_LEN(src));
+}
+
+void
+mrb_mruby_jsonsl_gem_test(mrb_state *mrb)
+{
+  struct RClass *test = mrb_define_module(mrb, "JSONSLTest");
+
+  mrb_define_module_function(mrb, test, "shares_buffer?", jsonsl_test_shares_buffer_p, MRB_ARGS_REQ(2));
+  /* see source_substr in src/mruby-jsonsl.c */
+#if MRUBY_RELEASE_NO < 20100 && defined(MRB_UTF8_STRING)
+  mrb_define_const(mrb, test, "SHARED_STRINGS", mrb_false_value());
+#else
+  mrb_define_const(mrb, test, "SHARED_STRINGS", mrb_true_value());
+#endif
+}
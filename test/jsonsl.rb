@@ -16,6 +16,51 @@ end
 assert('JSONSL#parse3') do
   assert_equal({"foo"=>[1,2,3.14,"hoge",{"a"=>"b"}]}, JSONSL.new.parse('{"foo":[1,2,3.14,"hoge",{"a":"b"}]}'))
 end
+assert('JSONSL#parse integers') do
+  assert_equal([0, 0, 7, -7, 1073741823, -1073741824], JSONSL.new.parse('[0,-0,7,-7,1073741823,-1073741824]'))
+  assert_raise(JSONSL::Error) do
+    JSONSL.new.parse('[-01]')
+  end
+end
+assert('JSONSL#parse pending_key member') do
+  assert_equal({"pending_key"=>1, "a"=>{"pending_key"=>[2]}}, JSONSL.new.parse('{"pending_key":1,"a":{"pending_key":[2]}}'))
+end
+assert('JSONSL#parse dedup_keys') do
+  parser = JSONSL.new
+  assert_equal([{"id"=>1, "ab"=>2}, {"id"=>3}], parser.parse('[{"id":1,"a\\u0062":2},{"id":3}]', {:dedup_keys => true}))
+  assert_equal({"id"=>4}, parser.parse('{"id":4}', {:dedup_keys => true}))
+  assert_equal({:id=>5}, parser.parse('{"id":5}', {:dedup_keys => true, :symbol_key => true}))
+end
+assert('JSONSL#parse symbol_key') do
+  parser = JSONSL.new
+  assert_equal({:id=>1, :ab=>2}, parser.parse('{"id":1,"a\\u0062":2}', {:symbol_key => true}))
+  assert_equal({:id=>1, "jsonsl_test_unknown"=>2}, parser.parse('{"id":1,"jsonsl_test_unknown":2}', {:symbol_key => :existing}))
+  assert_equal({:id=>1, "ab"=>2}, parser.parse('{"id":1,"ab":2}', {:symbol_key => [:id]}))
+  assert_raise(JSONSL::Error) do
+    parser.parse('{}', {:symbol_key => :all})
+  end
+end
+assert('JSONSL#parse shared_strings') do
+  src = '{"id":"a long enough string value","e":"x\\ty"}'
+  result = JSONSL.new.parse(src, {:shared_strings => true})
+  src[8, 4] = "LONG"
+  assert_equal({"id"=>"a long enough string value", "e"=>"x\ty"}, result)
+end
+assert('JSONSL#parse shared_strings shares the input') do
+  src = '["' + "a" * 40 + '","x\\t' + "y" * 40 + '"]'
+  copied = JSONSL.new.parse(src)
+  assert_false(JSONSLTest.shares_buffer?(copied[0], src))
+  shared = JSONSL.new.parse(src, {:shared_strings => true})
+  assert_equal(["a" * 40, "x\t" + "y" * 40], shared)
+  assert_equal(JSONSLTest::SHARED_STRINGS, JSONSLTest.shares_buffer?(shared[0], src))
+  # values with escapes are decoded into new Strings
+  assert_false(JSONSLTest.shares_buffer?(shared[1], src))
+  doc = JSONSL.lazy(src, {:shared_strings => true})
+  assert_equal(JSONSLTest::SHARED_STRINGS, JSONSLTest.shares_buffer?(doc[0], src))
+end
+assert('JSONSL#parse floats') do
+  assert_equal([0.5, -2.5, 0.0000001, 12345.678, 1.5e10], JSONSL.new.parse('[0.5,-25e-1,1E-7,12345.678,1.5e+10]'))
+end
 
 assert('JSONSL#parse_uescape1') do
   assert_equal({"foo"=>"barJC"}, JSONSL.new.parse('{"foo":"bar\\u004aC"}'))
@@ -27,7 +72,13 @@ assert('JSONSL#parse_uescape2b') do
   assert_equal({"foo"=>"abcテスト_!"}, JSONSL.new.parse('{"foo":"abc\\u30C6\\u30B9\\u30C8_!"}'))
 end
 assert('JSONSL#parse_uescape_surrogate_pair') do
-  assert_equal({"foo"=>"abc\xED\xA0\xB4\xED\xB4\x9E"}, JSONSL.new.parse('{"foo":"abc\\uD834\\uDD1E"}'))
+  assert_equal({"foo"=>"abc\xF0\x9D\x84\x9E"}, JSONSL.new.parse('{"foo":"abc\\uD834\\uDD1E"}'))
+end
+assert('JSONSL#parse_uescape_lone_surrogate') do
+  assert_equal(["\xEF\xBF\xBDx", "\xEF\xBF\xBD"], JSONSL.new.parse('["\\uD834x","\\uDD1E"]'))
+end
+assert('JSONSL#parse_escapes') do
+  assert_equal({"a\nb"=>"c\t\"d\\e/f"}, JSONSL.new.parse('{"a\\nb":"c\\t\\"d\\\\e\\/f"}'))
 end
 assert('JSONSL#parse_uescape_error') do
   assert_raise(JSONSL::Error) do
@@ -49,6 +100,36 @@ assert('JSONSL#parse_uescape_error4') do
     JSONSL.new.parse('{"foo":"abc\!"}')
   end
 end
+assert('JSONSL#parse control bytes around scan blocks') do
+  # input is classified 64 bytes at a time and runs are scanned 16 or 32
+  # bytes a step; a raw control byte on either side of those boundaries
+  # must still be found
+  parser = JSONSL.new
+  [16, 32, 64, 80, 96, 128].each do |b|
+    (b - 2..b + 1).each do |off|
+      assert_raise(JSONSL::Error) do
+        parser.parse('["' + "a" * (off - 2) + "\x01" + "b" * 70 + '"]')
+      end
+      assert_raise(JSONSL::Error) do
+        parser.parse('[' + " " * (off - 1) + "\x01" + " " * 70 + '1]')
+      end
+    end
+  end
+  assert_equal(["a" * 200], parser.parse('["' + "a" * 200 + '"]'))
+end
+assert('JSONSL#parse escapes around scan blocks') do
+  parser = JSONSL.new
+  escapes = [['\\"', '"'], ['\\\\', "\\"], ['\\u00e9', "\xC3\xA9"],
+             ["\xC3\xA9", "\xC3\xA9"], ["\xE3\x83\x86", "\xE3\x83\x86"]]
+  [16, 32, 64, 80, 96, 128].each do |b|
+    (b - 2..b + 1).each do |off|
+      escapes.each do |raw, value|
+        str = "a" * (off - 2) + value + "b" * 70
+        assert_equal([str], parser.parse('["' + "a" * (off - 2) + raw + "b" * 70 + '"]'))
+      end
+    end
+  end
+end
 
 assert('JSONSL.parse') do
   assert_equal({"foo"=>true}, JSONSL.parse('{"foo":true}'))
@@ -56,6 +137,14 @@ end
 assert('JSONSL.parse.hash') do
   assert_equal({:foo=>true}, JSONSL.new.parse('{"foo":true}',{:symbol_key => true}))
 end
+assert('JSONSL.parse reusing parsers') do
+  assert_equal({:foo=>[1]}, JSONSL.parse('{"foo":[1]}', {:symbol_key => true}))
+  assert_raise(JSONSL::Error) do
+    JSONSL.parse('{"foo":[1,')
+  end
+  assert_equal({"foo"=>[1]}, JSONSL.parse('{"foo":[1]}'))
+  assert_equal([true], JSONSL.parse('[true]'))
+end
 assert('JSONSL#dup') do
   json = JSONSL.new.dup.parse('{"foo":[1,2,3.14,"hoge",{"a":"b"}]}')
   assert_equal(json, json.dup)
@@ -85,3 +174,336 @@ assert('too much nested JSON and copy') do
   json2 = json.dup
   json2.parse(str)
 end
+assert('JSONSL#feed') do
+  str = '{"foo":["bar\\u004aC",12345,-6.5e3,true,null],"baz":{"a":"b"}}'
+  [1, 2, 3, 7, str.size].each do |size|
+    parser = JSONSL.new
+    pos = 0
+    while pos < str.size
+      parser.feed(str[pos, size])
+      pos += size
+    end
+    assert_equal({"foo"=>["barJC",12345,-6500.0,true,nil],"baz"=>{"a"=>"b"}}, parser.finish)
+  end
+end
+assert('JSONSL#feed with options') do
+  parser = JSONSL.new
+  parser.feed('{"fo', {:symbol_key => true})
+  parser.feed('o":true}')
+  assert_equal({:foo=>true}, parser.finish)
+end
+assert('JSONSL#finish unterminated') do
+  parser = JSONSL.new
+  parser.feed('{"foo":[1,')
+  assert_raise(JSONSL::Error) do
+    parser.finish
+  end
+  parser.feed('[1]')
+  assert_equal([1], parser.finish)
+end
+assert('JSONSL#feed stray closing bracket') do
+  parser = JSONSL.new
+  assert_raise(JSONSL::Error) do
+    parser.feed('[1]]')
+  end
+  parser.feed('[2]')
+  assert_equal([2], parser.finish)
+end
+assert('JSONSL#feed with GC between chunks') do
+  parser = JSONSL.new
+  parser.feed('{"a":[{"b":"' + "x" * 100 + '"},')
+  GC.start
+  parser.feed('"c"],"d":')
+  GC.start
+  parser.feed('{"e":1}}')
+  GC.start
+  assert_equal({"a"=>[{"b"=>"x" * 100},"c"],"d"=>{"e"=>1}}, parser.finish)
+end
+assert('JSONSL#parse pretty-printed with long indentation') do
+  json = "{\n"
+  3.times do |i|
+    indent = " " * (70 + i * 9)
+    json += indent + (i > 0 ? ',"k' : '"k') + i.to_s + "\" :\t\r\n"
+    json += indent + "[ 1 ,\n" + indent + "\t\t\"x\"   ]\n"
+  end
+  json += "}\n"
+  expected = {"k0"=>[1,"x"], "k1"=>[1,"x"], "k2"=>[1,"x"]}
+  parser = JSONSL.new
+  assert_equal(expected, parser.parse(json))
+  [1, 3, 7, 16, 33].each do |size|
+    pos = 0
+    while pos < json.size
+      parser.feed(json[pos, size])
+      pos += size
+    end
+    assert_equal(expected, parser.finish)
+  end
+end
+assert('JSONSL#parse large document') do
+  str = '[' + (0...3000).map { |i| '{"k":["' + i.to_s + '",' + i.to_s + '.5]}' }.join(',') + ']'
+  result = JSONSL.new.parse(str)
+  assert_equal(3000, result.size)
+  assert_equal({"k"=>["2999",2999.5]}, result[2999])
+end
+assert('JSONSL#parse duplicate keys') do
+  assert_equal({"a"=>2,"b"=>[],"c"=>{}}, JSONSL.new.parse('{"a":1,"b":[],"a":2,"c":{}}'))
+end
+class JSONSLTestReader
+  def initialize(str)
+    @str = str
+    @pos = 0
+  end
+  def read(len, buf)
+    return nil if @pos >= @str.size
+    buf.replace(@str[@pos, len])
+    @pos += len
+    buf
+  end
+end
+assert('JSONSL.parse_io') do
+  io = JSONSLTestReader.new('{"foo":["bar",1,2.5,{"baz":null}]}')
+  assert_equal({"foo"=>["bar",1,2.5,{"baz"=>nil}]}, JSONSL.parse_io(io, {:chunk_size => 4}))
+end
+assert('JSONSL#parse_io unterminated') do
+  assert_raise(JSONSL::Error) do
+    JSONSL.new.parse_io(JSONSLTestReader.new('{"foo":[1,2'))
+  end
+end
+assert('JSONSL#parse_io chunk_size') do
+  assert_raise(JSONSL::Error) do
+    JSONSL.new.parse_io(JSONSLTestReader.new('[1]'), {:chunk_size => 0})
+  end
+  assert_raise(JSONSL::Error) do
+    JSONSL.new.parse_io(JSONSLTestReader.new('[1]'), {:chunk_size => -1})
+  end
+end
+class JSONSLTestFreshReader < JSONSLTestReader
+  def read(len, buf)
+    return nil if @pos >= @str.size
+    str = @str[@pos, len]
+    @pos += len
+    str
+  end
+end
+assert('JSONSL#parse_io fresh Strings') do
+  io = JSONSLTestFreshReader.new('{"foo":["bar",12345,{"baz":null}]}')
+  assert_equal({"foo"=>["bar",12345,{"baz"=>nil}]}, JSONSL.new.parse_io(io, {:chunk_size => 3}))
+end
+assert('JSONSL#parse_io after feed') do
+  parser = JSONSL.new
+  parser.feed('[1,[2')
+  assert_equal([3], parser.parse_io(JSONSLTestReader.new('[3]')))
+end
+if JSONSL.new.respond_to?(:parse_fd) && Object.const_defined?(:IO) && IO.respond_to?(:pipe)
+  assert('JSONSL#parse_fd') do
+    json = '{"foo":["bar\\u004aC",12345,-6.5e3,true,null],"baz":{"a":"b"}}'
+    # small chunks make strings, numbers and literals span two reads
+    [1, 3, 7, 0x4000].each do |size|
+      r, w = IO.pipe
+      w.write(json)
+      w.close
+      assert_equal({"foo"=>["barJC",12345,-6500.0,true,nil],"baz"=>{"a"=>"b"}},
+                   JSONSL.new.parse_fd(r.fileno, {:chunk_size => size}))
+      r.close
+    end
+  end
+  assert('JSONSL#parse_fd errors') do
+    r, w = IO.pipe
+    w.write('{"a":[1,')
+    w.close
+    assert_raise(JSONSL::Error) do
+      JSONSL.new.parse_fd(r.fileno, {:chunk_size => 3})
+    end
+    fd = r.fileno
+    r.close
+    assert_raise(JSONSL::Error) do
+      JSONSL.new.parse_fd(fd)
+    end
+  end
+end
+assert('JSONSL#each_record') do
+  records = []
+  JSONSL.new.each_record("{\"a\":1}\n[true,\"x\"]\r\n\n{\"b\":null}") { |obj| records << obj }
+  assert_equal([{"a"=>1}, [true,"x"], {"b"=>nil}], records)
+end
+assert('JSONSL#each_record from IO') do
+  records = []
+  io = JSONSLTestReader.new("{\"a\":\"bcdefg\"}\n[1,22,333]\n")
+  JSONSL.new.each_record(io, {:chunk_size => 3}) { |obj| records << obj }
+  assert_equal([{"a"=>"bcdefg"}, [1,22,333]], records)
+end
+assert('JSONSL#each_record invalid record') do
+  assert_raise(JSONSL::Error) do
+    JSONSL.new.each_record("{\"a\":1}\n{\"b\":nil}\n") { |obj| }
+  end
+end
+assert('JSONSL#each_record skip_invalid') do
+  records = []
+  skipped = JSONSL.new.each_record("{\"a\":1}\n{\"b\":nil}\n[2]\n[3\n[4]", {:skip_invalid => true}) { |obj| records << obj }
+  assert_equal([{"a"=>1}, [2], [4]], records)
+  assert_equal([8, 22], skipped)
+end
+assert('JSONSL#each_value concatenated') do
+  values = []
+  JSONSL.new.each_value('{"a":1}{"b":[true,"x"]}[1,2] [3]') { |obj| values << obj }
+  assert_equal([{"a"=>1}, {"b"=>[true,"x"]}, [1,2], [3]], values)
+end
+assert('JSONSL#each_value json-seq') do
+  values = []
+  io = JSONSLTestReader.new("\x1e{\"a\":\"bcd\"}\n\x1e[1,22]\n")
+  JSONSL.new.each_value(io, {:chunk_size => 3}) { |obj| values << obj }
+  assert_equal([{"a"=>"bcd"}, [1,22]], values)
+end
+assert('JSONSL#each_value unterminated') do
+  assert_raise(JSONSL::Error) do
+    JSONSL.new.each_value('[1][2') { |obj| }
+  end
+end
+class JSONSLTestHandler
+  attr_reader :log
+  def initialize
+    @log = []
+  end
+  def start_object; @log << :start_object; end
+  def end_object; @log << :end_object; end
+  def start_array; @log << :start_array; end
+  def end_array; @log << :end_array; end
+  def key(k); @log << [:key, k]; end
+  def value(v); @log << [:value, v]; end
+  def events(list); @log << list; end
+end
+assert('JSONSL#parse_events') do
+  handler = JSONSL.new.parse_events('{"a":[1,{"b":null}],"c":"xyz"}', JSONSLTestHandler.new)
+  assert_equal([:start_object, [:key, "a"], :start_array, [:value, 1],
+                :start_object, [:key, "b"], [:value, nil], :end_object, :end_array,
+                [:key, "c"], [:value, "xyz"], :end_object], handler.log)
+end
+assert('JSONSL#parse_events batch') do
+  io = JSONSLTestReader.new('[1,{"k":false}]')
+  handler = JSONSL.new.parse_events(io, JSONSLTestHandler.new, {:batch => 3, :chunk_size => 2})
+  assert_equal([[:start_array, nil, :value, 1, :start_object, nil],
+                [:key, "k", :value, false, :end_object, nil],
+                [:end_array, nil]], handler.log)
+end
+class JSONSLTestFailingHandler < JSONSLTestHandler
+  def value(v); raise ArgumentError, "bad value" if v == 2; super; end
+  def events(list); raise ArgumentError, "bad value" if list.include?(2); super; end
+end
+assert('JSONSL#parse_events handler raising') do
+  parser = JSONSL.new
+  assert_raise(ArgumentError) do
+    parser.parse_events('[1,2,3]', JSONSLTestFailingHandler.new, {:batch => 1})
+  end
+  assert_raise(ArgumentError) do
+    parser.parse_events('[1,2,3]', JSONSLTestFailingHandler.new)
+  end
+  assert_equal([1,{"a"=>[2]}], parser.parse('[1,{"a":[2]}]'))
+  handler = parser.parse_events('[4]', JSONSLTestHandler.new)
+  assert_equal([:start_array, [:value, 4], :end_array], handler.log)
+end
+assert('JSONSL#extract') do
+  json = '{"user":{"id":42,"name":"x"},"items":[{"price":1.5},{"price":2},{"n":3}],"tail":[true,null]}'
+  result = JSONSL.new.extract(json, ["/user/id", "/items/^/price", "/items/2", "/none"])
+  assert_equal(42, result["/user/id"])
+  assert_equal([1.5, 2], result["/items/^/price"])
+  assert_equal({"n"=>3}, result["/items/2"])
+  assert_false(result.has_key?("/none"))
+end
+assert('JSONSL#extract invalid pointer') do
+  assert_raise(JSONSL::Error) do
+    JSONSL.new.extract('{"a":1}', ["a"])
+  end
+end
+assert('JSONSL#extract non-String pointer') do
+  assert_raise(JSONSL::Error) do
+    JSONSL.new.extract('{"a":1}', [:a])
+  end
+  assert_raise(JSONSL::Error) do
+    JSONSL.new.each_match('[1]', ["/0", 1]) { |v| }
+  end
+  parser = JSONSL.new
+  assert_raise(JSONSL::Error) do
+    parser.extract('{"a":1}', ["/a\0"])
+  end
+  assert_equal({"/a"=>1}, parser.extract('{"a":1}', ["/a"]))
+end
+assert('JSONSL#each_match') do
+  values = []
+  io = JSONSLTestReader.new('[{"id":1,"tags":["a"]},{"id":22},3.5,"s"]')
+  JSONSL.new.each_match(io, "/^", {:chunk_size => 4}) { |v| values << v }
+  assert_equal([{"id"=>1,"tags"=>["a"]}, {"id"=>22}, 3.5, "s"], values)
+end
+assert('JSONSL#each_match with pointers') do
+  matches = []
+  JSONSL.new.each_match('[{"id":1,"tags":["a","b"]},{"id":22}]', ["/^/id", "/^/tags/^"]) do |v, pointer|
+    matches << [pointer, v]
+  end
+  assert_equal([["/^/id", 1], ["/^/tags/^", "a"], ["/^/tags/^", "b"], ["/^/id", 22]], matches)
+end
+assert('JSONSL#each_match break') do
+  parser = JSONSL.new
+  first = parser.each_match('[{"id":1},{"id":2}]', "/^/id") { |v| break v }
+  assert_equal(1, first)
+  assert_raise(ArgumentError) do
+    parser.each_match('[[1,[2]],[3]]', "/^") { |v| raise ArgumentError }
+  end
+  assert_equal({"a"=>[1,{"b"=>2}]}, parser.parse('{"a":[1,{"b":2}]}'))
+  values = []
+  parser.each_match('[5,6]', "/1") { |v| values << v }
+  assert_equal([6], values)
+end
+assert('JSONSL#extract overlapping pointers') do
+  json = '{"a":{"b":{"x":1,"y":2},"c":{"x":3}},"l":[5,6]}'
+  result = JSONSL.new.extract(json, ["/a/^/x", "/a/b/x", "/a/b", "/l/1", "/^/1"])
+  assert_equal([1, 3], result["/a/^/x"])
+  assert_equal(1, result["/a/b/x"])
+  assert_equal({"x"=>1,"y"=>2}, result["/a/b"])
+  assert_equal(6, result["/l/1"])
+  assert_equal([6], result["/^/1"])
+end
+assert('JSONSL.lazy') do
+  doc = JSONSL.lazy('{"user":{"id":42,"name":"x"},"items":[{"price":1.5},{"price":2}],"e":[]}')
+  assert_equal(3, doc.size)
+  assert_equal(["user", "items", "e"], doc.keys)
+  assert_equal(42, doc["user"]["id"])
+  assert_equal(2, doc.dig("items", -1, "price"))
+  assert_nil(doc.dig("items", 5, "price"))
+  assert_true(doc["items"].array?)
+  assert_equal({"id"=>42, "name"=>"x"}, doc["user"].value)
+  assert_equal([], doc["e"].value)
+  assert_nil(doc["none"])
+end
+assert('JSONSL.lazy caches values') do
+  doc = JSONSL.lazy('{"a":{"b":"c"}}')
+  assert_true(doc["a"].equal?(doc["a"]))
+  assert_true(doc["a"]["b"].equal?(doc[:a][:b]))
+end
+assert('JSONSL.lazy duplicate keys') do
+  doc = JSONSL.lazy('{"a":1,"b":[],"a":2,"c":{}}')
+  assert_equal(2, doc["a"])
+  assert_equal(2, doc[:a])
+  assert_equal(["a", "b", "c"], doc.keys)
+  assert_equal(3, doc.size)
+  assert_equal(doc.value.keys, doc.keys)
+  assert_equal(JSONSL.parse('{"a":1,"b":[],"a":2,"c":{}}'), doc.value)
+end
+assert('JSONSL.lazy array walk') do
+  doc = JSONSL.lazy('[' + (0...100).map { |i| '{"i":' + i.to_s + '}' }.join(',') + ']')
+  100.times do |i|
+    assert_equal(i, doc[i]["i"])
+  end
+  assert_equal(5, doc.dig(5, "i"))
+  assert_equal(99, doc[-1]["i"])
+  assert_equal(0, doc[0]["i"])
+end
+assert('JSONSL.lazy escaped keys') do
+  doc = JSONSL.lazy('{' + (0...50).map { |i| '"k\\u0041' + i.to_s + '":' + i.to_s }.join(',') + '}')
+  assert_equal(49, doc["kA49"])
+  assert_equal(0, doc[:kA0])
+  assert_nil(doc["k\\u00410"])
+end
+assert('JSONSL.lazy error') do
+  assert_raise(JSONSL::Error) do
+    JSONSL.lazy('{"a":[1,}')
+  end
+end